@@ -44,6 +44,7 @@
 #include <avr/pgmspace.h>
 #include <avr/boot.h>
 #include <avr/interrupt.h>
+#include <util/crc16.h>
 
 // usb pins
 #define C0_TXE 0x01
@@ -53,7 +54,7 @@
 
 /* STK500 constants list, from AVRDUDE */
 #define STK_OK              0x10
-#define STK_FAILED          0x11  // Not used
+#define STK_FAILED          0x11
 #define STK_UNKNOWN         0x12  // Not used
 #define STK_NODEVICE        0x13  // Not used
 #define STK_INSYNC          0x14  // ' '
@@ -91,6 +92,14 @@
 #define STK_READ_FUSE_EXT   0x77  // 'w'
 #define STK_READ_OSCCAL_EXT 0x78  // 'x'
 
+/* mk additions, see mk-flash.c */
+#define MK_READ_CRC         0x7A  // 'z', crc of the page at address
+#define MK_PROG_STREAM      0x79  // 'y', pages from an address, one reply
+#define MK_PARM_FEATURES    0xA0  // STK_GET_PARAMETER: 0x80 | the MK_HAS_ bits
+#define MK_HAS_CRC          0x01  // MK_READ_CRC
+#define MK_HAS_STREAM       0x02  // MK_PROG_STREAM
+#define APP_END             0x7c00  // LDSECTION in the Makefile
+
 /* Watchdog settings */
 #define WATCHDOG_OFF    (0)
 #define WATCHDOG_16MS   (_BV(WDE))
@@ -115,6 +124,10 @@ static inline void getNch(uint8_t); /* "static inline" is a compiler hint to red
 void verifySpace();
 uint8_t getLen();
 static inline void watchdogReset();
+void erasePage();
+void eraseStart();
+void writePage();
+void flashReady();
 void watchdogConfig(uint8_t x);
 void appStart() __attribute__ ((naked));
 
@@ -124,6 +137,7 @@ void appStart() __attribute__ ((naked));
 #define buff    ((uint8_t*)(0x100))
 #define address (*(uint16_t*)(0x200))
 #define length  (*(uint8_t*)(0x202))
+#define erase_due (*(uint8_t*)(0x203))
 
 /* main program starts here */
 int main(void) {
@@ -137,6 +151,7 @@ int main(void) {
 	if (!(ch & _BV(EXTRF))) appStart();
 
 	watchdogConfig(WATCHDOG_OFF);
+	erase_due = 0;
 
 	DDRD = 0;
 	PORTD = 0;
@@ -147,9 +162,12 @@ int main(void) {
 		ch = getch();
 		
 		if(ch == STK_GET_PARAMETER) {
-			// GET PARAMETER returns a generic 0x03 reply - enough to keep Avrdude happy
-			getNch(1);
-			putch(0x03);
+			// GET PARAMETER returns a generic 0x03 reply - enough to keep Avrdude happy.
+			// MK_PARM_FEATURES names the mk commands, older bootloaders answer
+			// it with 0x03 too, which has bit 7 clear
+			ch = getch();
+			verifySpace();
+			putch(ch == MK_PARM_FEATURES ? 0x80 | MK_HAS_CRC | MK_HAS_STREAM : 0x03);
 		}
 		else if(ch == STK_SET_DEVICE) {
 			// SET DEVICE is ignored
@@ -175,14 +193,11 @@ int main(void) {
 	    else if(ch == STK_PROG_PAGE) {
 	      // PROGRAM PAGE - we support flash programming only, not EEPROM
 	      uint8_t *bufPtr;
-	      uint16_t addrPtr;
 
+	      // Erase while the page comes in
+	      erasePage();
 	      getLen();
 
-	      // Immediately start page erase - this will 4.5ms
-	      boot_page_erase((uint16_t)(void*)address);
-
-	      // While that is going on, read in page contents
 	      bufPtr = buff;
 	      do *bufPtr++ = getch();
 	      while (--length);
@@ -190,38 +205,74 @@ int main(void) {
 	      // Read command terminator, start reply
 	      verifySpace();
 
-	      // If only a partial page is to be programmed, the erase might not be complete.
-	      // So check that here
-	      boot_spm_busy_wait();
-
-	      // Copy buffer into programming buffer
-	      bufPtr = buff;
-	      addrPtr = (uint16_t)(void*)address;
-	      ch = SPM_PAGESIZE / 2;
-	      do {
-	        uint16_t a;
-	        a = *bufPtr++;
-	        a |= (*bufPtr++) << 8;
-	        boot_page_fill((uint16_t)(void*)addrPtr,a);
-	        addrPtr += 2;
-	      } while (--ch);
-
-	      // Write from programming buffer
-	      boot_page_write((uint16_t)(void*)address);
-	      boot_spm_busy_wait();
-
-	      // Reenable read access to flash
-	      boot_rww_enable();
+	      writePage();
 	    }
+// Many pages for one reply, see mk-flash.c
+		else if(ch == MK_PROG_STREAM) {
+			// PROGRAM STREAM - after STK_INSYNC MK_PROG_STREAM: word address,
+			// page count (0 is 256),
+			// whole pages, and the crc of all their bytes. answers STK_OK or
+			// STK_FAILED once, the pages are written either way. a run that
+			// does not fit below APP_END is read but none of it is written,
+			// and answers STK_FAILED
+			uint8_t *bufPtr;
+			uint8_t count;
+			uint8_t fail;
+			uint16_t crc = 0xffff;
+
+			verifySpace();
+			putch(MK_PROG_STREAM);
+
+			address = getch();
+			address = (address & 0xff) | (getch() << 8);
+			count = getch();
+
+			// in words, before doubling can wrap. count 0 is 256 pages,
+			// more than fit anywhere
+			fail = address >= APP_END / 2 ||
+				(uint8_t)(count - 1) >= (APP_END / 2 - address) / (SPM_PAGESIZE / 2);
+			address += address;
+
+			do {
+				if (!fail) erasePage();
+				bufPtr = buff;
+				length = SPM_PAGESIZE;
+				do crc = _crc_ccitt_update(crc, *bufPtr++ = getch());
+				while (--length);
+
+				if (!fail) writePage();
+				address += SPM_PAGESIZE;
+			} while (--count);
+
+			crc ^= getch();
+			crc ^= getch() << 8;
+			putch((crc | fail) ? STK_FAILED : STK_OK);
+		}
 // Read memory block mode, length is big endian.  
 		else if(ch == STK_READ_PAGE) {
 			// READ PAGE - we only read flash
 			getLen();
 			verifySpace();
+			flashReady();
 
 			do putch(pgm_read_byte_near(address++));
 			while (--length);
 		}
+// Page crc, so a flasher can skip pages that are already right
+		else if(ch == MK_READ_CRC) {
+			// READ CRC - _crc_ccitt_update over SPM_PAGESIZE bytes from 0xffff,
+			// low byte first, and address moves on to the next page
+			uint16_t crc = 0xffff;
+
+			verifySpace();
+			flashReady();
+
+			ch = SPM_PAGESIZE;
+			do crc = _crc_ccitt_update(crc, pgm_read_byte_near(address++));
+			while (--ch);
+			putch(crc);
+			putch(crc >> 8);
+		}
 
 // Get device signature bytes  
 		else if(ch == STK_READ_SIGN) {
@@ -261,9 +312,11 @@ uint8_t getch(void) {
 
 //  watchdogReset();
 
+	eraseStart();
+
 	PORTD = 0;              // setup PORTD for input
 	DDRD = 0;               // input w/ tristate	
-	while((PINC & C1_RXF));	// wait for data
+	while((PINC & C1_RXF)) eraseStart();	// wait for data
 	PORTC |= C3_RD;
 	c = PIND;
 	PORTC &= ~(C3_RD);
@@ -289,6 +342,56 @@ uint8_t getLen() {
   return getch();
 }
 
+// Erases the page at address once the last write is done. The write
+// copied its page out of buff before it started, so the next page comes
+// into buff meanwhile, and getch() starts the erase (4.5ms) between its
+// bytes as soon as the write ends. One ram page does for both
+void erasePage() {
+  erase_due = 1;
+}
+
+void eraseStart() {
+  if (erase_due && !boot_spm_busy()) {
+    boot_page_erase((uint16_t)(void*)address);
+    erase_due = 0;
+  }
+}
+
+// Programs the page at address from buff once its erase is done. The
+// write is left running: the reply goes out and the next command comes
+// in meanwhile, the next erase or flashReady() waits for it
+void writePage() {
+  uint8_t *bufPtr;
+  uint16_t addrPtr;
+  uint8_t ch;
+
+  // The programming buffer can't be filled while the erase runs
+  do eraseStart(); while (erase_due);
+  boot_spm_busy_wait();
+
+  // Copy buffer into programming buffer
+  bufPtr = buff;
+  addrPtr = (uint16_t)(void*)address;
+  ch = SPM_PAGESIZE / 2;
+  do {
+    uint16_t a;
+    a = *bufPtr++;
+    a |= (*bufPtr++) << 8;
+    boot_page_fill((uint16_t)(void*)addrPtr,a);
+    addrPtr += 2;
+  } while (--ch);
+
+  // Write from programming buffer
+  boot_page_write((uint16_t)(void*)address);
+}
+
+// Waits for a page write writePage() left running and reenables
+// read access to flash
+void flashReady() {
+	boot_spm_busy_wait();
+	boot_rww_enable();
+}
+
 // Watchdog functions. These are only safe with interrupts turned off.
 void watchdogReset() {
   __asm__ __volatile__ (
@@ -304,6 +407,7 @@ void watchdogConfig(uint8_t x) {
 
 void appStart() {
  // watchdogConfig(WATCHDOG_OFF);
+  flashReady();
   __asm__ __volatile__ (
     // Jump to RST vector
     "clr r30\n"
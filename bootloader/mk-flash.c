@@ -0,0 +1,397 @@
+/************************************************************************
+mk-flash: firmware upload through mk-boot, changed pages only
+*************************************************************************
+asks the bootloader for the crc of every page the hex file covers
+(MK_READ_CRC, see mk-boot.c) and writes only the pages whose crc differs
+from the file's, then checks them the same way. pages that are already
+right are never erased. each run of neighbouring pages goes out as one
+MK_PROG_STREAM with a single reply, instead of the two round trips per
+page of STK_LOAD_ADDRESS and STK_PROG_PAGE.
+
+usage: mk-flash [-a] [-1] <device> <file.hex>
+
+  -a  write every page, as avrdude -c arduino -D does
+  -1  one STK_PROG_PAGE per page, as avrdude does, to compare
+
+the bootloader runs after a reset, mk-flash waits 5s for it, then asks
+which mk commands it has (STK_GET_PARAMETER MK_PARM_FEATURES, which an
+older one answers with its generic 0x03). without MK_READ_CRC the pages
+are read back with STK_READ_PAGE and compared here instead, without
+MK_PROG_STREAM they go out with STK_PROG_PAGE. the device stays in the
+bootloader afterwards, as with avrdude.
+
+builds on the host: make mk-flash
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <time.h>
+
+// from mk-boot.c
+#define STK_INSYNC			0x14
+#define STK_OK				0x10
+#define STK_FAILED			0x11
+#define CRC_EOP				0x20
+#define STK_GET_SYNC		0x30
+#define STK_GET_PARAMETER	0x41
+#define STK_LEAVE_PROGMODE	0x51
+#define STK_LOAD_ADDRESS	0x55
+#define STK_PROG_PAGE		0x64
+#define STK_READ_PAGE		0x74
+#define MK_READ_CRC			0x7a
+#define MK_PROG_STREAM		0x79
+#define MK_PARM_FEATURES	0xa0
+#define MK_HAS_CRC			0x01
+#define MK_HAS_STREAM		0x02
+
+#define PAGE_SIZE		128			// SPM_PAGESIZE, atmega325
+#define APP_END			0x7c00		// LDSECTION in the Makefile
+#define PAGES			(APP_END / PAGE_SIZE)
+
+#define SYNC_TRIES		25			// 200ms each
+#define PAGE_WRITE_US	10000		// erase, write and usb, when nothing was written to time
+
+static uint8_t image[APP_END];
+static uint16_t image_pages;		// pages the file covers, from 0
+static int fd;
+static int has_stream = 1;			// MK_PROG_STREAM, if the bootloader has it
+
+static int64_t now_us(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+// as _crc_ccitt_update in avr-libc's util/crc16.h
+static uint16_t crc_ccitt_update(uint16_t crc, uint8_t data)
+{
+	data ^= crc & 0xff;
+	data ^= data << 4;
+	return ((uint16_t)data << 8 | crc >> 8) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3);
+}
+
+static uint16_t page_crc(const uint8_t *p)
+{
+	uint16_t crc = 0xffff;
+	uint8_t i;
+
+	for(i=0;i<PAGE_SIZE;i++) crc = crc_ccitt_update(crc, p[i]);
+	return crc;
+}
+
+
+// intel hex
+// ===============================================================
+static uint8_t hex_byte(const char *s)
+{
+	char b[3] = { s[0], s[1], 0 };
+
+	return strtoul(b, NULL, 16);
+}
+
+static int load_hex(const char *name)
+{
+	char line[600];
+	uint8_t n, type, sum, i;
+	uint32_t base = 0, at, line_no = 0;
+	FILE *f;
+
+	f = fopen(name, "r");
+	if(!f) { perror(name); return 0; }
+
+	memset(image, 0xff, sizeof(image));
+	image_pages = 0;
+
+	while(fgets(line, sizeof(line), f)) {
+		line_no++;
+		if(line[0] != ':') continue;
+		if(strlen(line) < 11) goto bad;
+		n = hex_byte(line + 1);
+		if(strspn(line + 1, "0123456789abcdefABCDEF") < 10u + n * 2) goto bad;
+		for(sum=0,i=0;i<n+5;i++) sum += hex_byte(line + 1 + i * 2);
+		if(sum) goto bad;
+
+		at = hex_byte(line + 3) << 8 | hex_byte(line + 5);
+		type = hex_byte(line + 7);
+		if(type == 0x01) break;
+		if(type == 0x02) base = (hex_byte(line + 9) << 8 | hex_byte(line + 11)) << 4;
+		else if(type == 0x04) base = (hex_byte(line + 9) << 8 | hex_byte(line + 11)) << 16;
+		else if(type == 0x00) {
+			at += base;
+			if(at + n > APP_END) {
+				fprintf(stderr, "%s:%u: 0x%04x is past the application section\n", name, line_no, at + n);
+				fclose(f);
+				return 0;
+			}
+			for(i=0;i<n;i++) image[at + i] = hex_byte(line + 9 + i * 2);
+			if(n && (at + n + PAGE_SIZE - 1) / PAGE_SIZE > image_pages)
+				image_pages = (at + n + PAGE_SIZE - 1) / PAGE_SIZE;
+		}
+	}
+	fclose(f);
+	return 1;
+
+bad:
+	fprintf(stderr, "%s:%u: not an intel hex record\n", name, line_no);
+	fclose(f);
+	return 0;
+}
+
+
+// stk500 over the ft245
+// ===============================================================
+// exactly n bytes, or 0 once nothing has come for ms
+static int expect(uint8_t *b, uint32_t n, int ms)
+{
+	struct pollfd p;
+	ssize_t r;
+
+	p.fd = fd;
+	p.events = POLLIN;
+	while(n) {
+		if(poll(&p, 1, ms) <= 0) return 0;
+		r = read(fd, b, n);
+		if(r <= 0) return 0;
+		b += r;
+		n -= r;
+	}
+	return 1;
+}
+
+static int send(const uint8_t *b, uint32_t n)
+{
+	ssize_t r;
+
+	while(n) {
+		r = write(fd, b, n);
+		if(r <= 0) { perror("write"); return 0; }
+		b += r;
+		n -= r;
+	}
+	return 1;
+}
+
+// a command and its reply: STK_INSYNC, n bytes into reply, STK_OK
+static int command(const uint8_t *c, uint32_t len, uint8_t *reply, uint32_t n)
+{
+	uint8_t b;
+
+	if(!send(c, len)) return 0;
+	if(!expect(&b, 1, 1000) || b != STK_INSYNC) return 0;
+	if(n && !expect(reply, n, 1000)) return 0;
+	return expect(&b, 1, 1000) && b == STK_OK;
+}
+
+static int sync_boot(void)
+{
+	static const uint8_t c[] = { STK_GET_SYNC, CRC_EOP };
+	uint8_t b[2];
+	int i;
+
+	for(i=0;i<SYNC_TRIES;i++) {
+		tcflush(fd, TCIOFLUSH);
+		if(!send(c, 2)) return 0;
+		if(expect(b, 2, 200) && b[0] == STK_INSYNC && b[1] == STK_OK) {
+			while(expect(b, 1, 50));		// answers to earlier tries
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int load_address(uint16_t page)
+{
+	uint16_t word = page * (PAGE_SIZE / 2);
+	uint8_t c[4] = { STK_LOAD_ADDRESS, word, word >> 8, CRC_EOP };
+
+	return command(c, 4, NULL, 0);
+}
+
+static int write_page(uint16_t page)
+{
+	uint8_t c[PAGE_SIZE + 5] = { STK_PROG_PAGE, 0, PAGE_SIZE, 'F' };
+
+	memcpy(c + 4, image + page * PAGE_SIZE, PAGE_SIZE);
+	c[PAGE_SIZE + 4] = CRC_EOP;
+	return load_address(page) && command(c, sizeof(c), NULL, 0);
+}
+
+// pages first to first + n - 1 in one MK_PROG_STREAM, in one write. 1
+// if they all went, 0 if the bootloader was lost, -1 if its checksum
+// did not match or the pages do not fit below APP_END
+static int stream_pages(uint16_t first, uint16_t n)
+{
+	static uint8_t c[2 + 3 + PAGES * PAGE_SIZE + 2];
+	uint16_t crc = 0xffff, word = first * (PAGE_SIZE / 2);
+	uint32_t i, len = 0;
+	uint8_t b[2];
+
+	c[len++] = MK_PROG_STREAM;
+	c[len++] = CRC_EOP;
+	c[len++] = word;
+	c[len++] = word >> 8;
+	c[len++] = n;
+	for(i=0;i<n*PAGE_SIZE;i++) {
+		c[len] = image[first * PAGE_SIZE + i];
+		crc = crc_ccitt_update(crc, c[len++]);
+	}
+	c[len++] = crc;
+	c[len++] = crc >> 8;
+	if(!send(c, len)) return 0;
+
+	if(!expect(b, 2, 1000) || b[0] != STK_INSYNC || b[1] != MK_PROG_STREAM)
+		return 0;
+	// one reply once every page is written, about 9ms each
+	if(!expect(b, 2, 1000 + n * 20) || b[1] != STK_OK) return 0;
+	if(b[0] != STK_OK) {
+		fprintf(stderr, "stream of pages %u-%u failed its checksum or range\n", first, first + n - 1);
+		return -1;
+	}
+	return 1;
+}
+
+// the MK_HAS_ bits of the bootloader's mk commands, 0 for an older one,
+// -1 if it was lost
+static int features(void)
+{
+	static const uint8_t c[] = { STK_GET_PARAMETER, MK_PARM_FEATURES, CRC_EOP };
+	uint8_t b;
+
+	if(!command(c, 3, &b, 1)) return -1;
+	return b & 0x80 ? b & 0x7f : 0;
+}
+
+// crcs of pages first to first + n - 1, all asked for in one write
+static int read_crcs(uint16_t first, uint16_t n, uint16_t *crc, int has_crc)
+{
+	static uint8_t c[PAGES * 2], r[PAGES * 4];
+	static const uint8_t read_page[] = { STK_READ_PAGE, 0, PAGE_SIZE, 'F', CRC_EOP };
+	uint8_t page[PAGE_SIZE];
+	uint16_t i;
+
+	if(!n) return 1;
+	if(!load_address(first)) return 0;
+
+	if(has_crc) {
+		for(i=0;i<n;i++) {
+			c[i * 2] = MK_READ_CRC;
+			c[i * 2 + 1] = CRC_EOP;
+		}
+		if(!send(c, n * 2) || !expect(r, n * 4, 1000)) return 0;
+		for(i=0;i<n;i++) {
+			if(r[i * 4] != STK_INSYNC || r[i * 4 + 3] != STK_OK) return 0;
+			crc[i] = r[i * 4 + 1] | r[i * 4 + 2] << 8;
+		}
+		return 1;
+	}
+
+	// STK_READ_PAGE moves address on as well
+	for(i=0;i<n;i++) {
+		if(!command(read_page, sizeof(read_page), page, PAGE_SIZE)) return 0;
+		crc[i] = page_crc(page);
+	}
+	return 1;
+}
+
+
+// ===============================================================
+int main(int argc, char **argv)
+{
+	static uint16_t crc[PAGES], after[PAGES];
+	static uint8_t differs[PAGES + 1];
+	static const uint8_t leave[] = { STK_LEAVE_PROGMODE, CRC_EOP };
+	uint16_t p, n, i, written, failed;
+	int64_t start, write_us, all_us;
+	int arg, all = 0, has, has_crc, r;
+	struct termios t;
+
+	for(arg=1;arg<argc && argv[arg][0] == '-';arg++) {
+		if(!strcmp(argv[arg], "-a")) all = 1;
+		else if(!strcmp(argv[arg], "-1")) has_stream = 0;
+		else break;
+	}
+	if(argc - arg != 2) {
+		fprintf(stderr, "usage: mk-flash [-a] [-1] <device> <file.hex>\n");
+		return 2;
+	}
+	if(!load_hex(argv[arg + 1])) return 2;
+	if(!image_pages) {
+		fprintf(stderr, "%s: no data\n", argv[arg + 1]);
+		return 2;
+	}
+
+	fd = open(argv[arg], O_RDWR | O_NOCTTY);
+	if(fd < 0) { perror(argv[arg]); return 2; }
+	if(!tcgetattr(fd, &t)) {
+		cfmakeraw(&t);
+		t.c_cc[VMIN] = 0;
+		t.c_cc[VTIME] = 0;
+		tcsetattr(fd, TCSANOW, &t);
+	}
+
+	if(!sync_boot()) {
+		fprintf(stderr, "%s: no bootloader, reset the device and try again\n", argv[arg]);
+		return 1;
+	}
+	start = now_us();
+
+	if((has = features()) < 0) goto lost;
+	has_crc = (has & MK_HAS_CRC) != 0;
+	if(!(has & MK_HAS_STREAM)) has_stream = 0;
+	if(!has_crc) printf("bootloader has no MK_READ_CRC, reading pages back instead\n");
+
+	// which pages differ
+	if(!all && !read_crcs(0, image_pages, crc, has_crc)) goto lost;
+
+	for(written=0,p=0;p<image_pages;p++)
+		written += differs[p] = all || crc[p] != page_crc(image + p * PAGE_SIZE);
+
+	// a run of differing pages at a time
+	write_us = now_us();
+	for(p=0;p<image_pages;p+=n) {
+		for(n=0;differs[p + n];n++);
+		if(!n) { n = 1; continue; }
+
+		r = has_stream ? stream_pages(p, n) : -1;
+		if(!r) goto lost;
+		for(i=0;r < 0 && i<n;i++)
+			if(!write_page(p + i)) goto lost;
+	}
+	write_us = now_us() - write_us;
+
+	// written pages must read back as the file
+	for(failed=0,p=0;p<image_pages;p+=n) {
+		for(n=0;differs[p + n];n++);
+		if(!n) { n = 1; continue; }
+
+		if(!read_crcs(p, n, after, has_crc)) goto lost;
+		for(i=0;i<n;i++) {
+			if(after[i] == page_crc(image + (p + i) * PAGE_SIZE)) continue;
+			fprintf(stderr, "page %u (0x%04x) did not verify\n", p + i, (p + i) * PAGE_SIZE);
+			failed++;
+		}
+	}
+
+	if(!command(leave, 2, NULL, 0)) goto lost;
+	close(fd);
+
+	all_us = (written ? write_us / written : PAGE_WRITE_US) * image_pages;
+	printf("%s: %u pages, %u written, %u skipped, %.2fs\n", argv[arg + 1], image_pages, written,
+		image_pages - written, (now_us() - start) / 1e6);
+	if(!all)
+		printf("writing every page would take about %.2fs, %.2fs saved\n", all_us / 1e6,
+			(all_us - (now_us() - start)) / 1e6);
+	return failed ? 1 : 0;
+
+lost:
+	fprintf(stderr, "%s: bootloader stopped answering\n", argv[arg]);
+	return 1;
+}
@@ -0,0 +1,178 @@
+/************************************************************************
+frame diff benchmark
+*************************************************************************
+runs animation traces on a 16x16 grid through writer::frame() and
+compares the bytes sent per frame with four full _LED_MAP packets (44
+bytes), what a host that resends the whole frame writes.
+
+usage: bench
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mk.h"
+
+#define FRAMES 6000			// 100s at 60 fps
+#define FPS 60
+#define NAIVE 44
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void set(uint16_t *f, int x, int y, int on)
+{
+	x &= 15;
+	y &= 15;
+	if(on) f[y] |= 1 << x;
+	else f[y] &= ~(1 << x);
+}
+
+static int get(const uint16_t *f, int x, int y)
+{
+	return (f[y & 15] >> (x & 15)) & 1;
+}
+
+
+// traces: each turns the last frame into the next
+// ===============================================================
+// one led walking the grid
+static void chase(uint16_t *f, int t)
+{
+	memset(f, 0, 32);
+	set(f, t % 16, t / 16 % 16, 1);
+}
+
+// a key toggled now and then, as a step sequencer's grid sees it
+static void toggles(uint16_t *f, int t)
+{
+	if(t % 8 == 0) f[rand() % 16] ^= 1 << (rand() % 16);
+}
+
+// sequencer playhead: one column lit over the toggled steps
+static void playhead(uint16_t *f, int t)
+{
+	static uint16_t steps[16];
+	int y;
+
+	if(t % 8 == 0) steps[rand() % 16] ^= 1 << (rand() % 16);
+	for(y=0;y<16;y++) f[y] = steps[y] ^ (1 << (t / 4 % 16));
+}
+
+// drops falling a row a frame
+static void rain(uint16_t *f, int t)
+{
+	int y;
+
+	for(y=15;y>0;y--) f[y] = f[y-1];
+	f[0] = 0;
+	if(rand() % 3 == 0) f[0] |= 1 << (rand() % 16);
+}
+
+// 16 bar meters, each level wandering by one
+static void meters(uint16_t *f, int t)
+{
+	static int level[16];
+	int x, y;
+
+	for(x=0;x<16;x++) {
+		level[x] += rand() % 3 - 1;
+		if(level[x] < 0) level[x] = 0;
+		if(level[x] > 16) level[x] = 16;
+		for(y=0;y<16;y++) set(f, x, 15 - y, y < level[x]);
+	}
+}
+
+// text scrolling a column every 4 frames
+static void scroll(uint16_t *f, int t)
+{
+	static uint16_t column;
+	int y;
+
+	if(t % 4) return;
+	if(t % 24 == 0) column = rand() & 0x7ffe;
+	for(y=0;y<16;y++) f[y] = f[y] >> 1 | ((column >> y) & 1) << 15;
+	if(t % 24 >= 20) column = 0;
+}
+
+// conway's life on a torus, reseeded when it settles
+static void life(uint16_t *f, int t)
+{
+	uint16_t n[16];
+	int x, y, dx, dy, c;
+
+	if(t % 300 == 0) for(y=0;y<16;y++) f[y] = rand();
+	for(y=0;y<16;y++) {
+		n[y] = 0;
+		for(x=0;x<16;x++) {
+			for(c=0,dy=-1;dy<2;dy++)
+				for(dx=-1;dx<2;dx++)
+					if(dx || dy) c += get(f, x+dx, y+dy);
+			if(c == 3 || (c == 2 && get(f, x, y))) n[y] |= 1 << x;
+		}
+	}
+	memcpy(f, n, 32);
+}
+
+// every frame new: the worst case
+static void noise(uint16_t *f, int t)
+{
+	int y;
+
+	for(y=0;y<16;y++) f[y] = rand();
+}
+
+
+// ===============================================================
+static void bench(const char *name, void (*trace)(uint16_t *, int))
+{
+	static uint8_t buf[256];
+	mk::writer w(buf, sizeof(buf));
+	uint16_t last[16], next[16];
+	uint32_t bytes, most;
+	double t, spent;
+	int i;
+
+	srand(1);
+	memset(last, 0, sizeof(last));
+	memcpy(next, last, sizeof(next));
+	bytes = most = 0;
+	spent = 0;
+
+	for(i=0;i<FRAMES;i++) {
+		trace(next, i);
+		t = now();
+		w.frame(last, next, 16, 16);
+		spent += now() - t;
+		bytes += w.size();
+		if(w.size() > most) most = w.size();
+		w.clear();
+		memcpy(last, next, sizeof(last));
+	}
+
+	printf("%-10s %6.2f bytes/frame  %3u max  %5.1f%% of full maps  %6.0f bytes/s at %d fps  %5.1f us/frame host\n",
+		name, (double)bytes / FRAMES, most, 100.0 * bytes / FRAMES / NAIVE,
+		(double)bytes / FRAMES * FPS, FPS, spent / FRAMES * 1e6);
+}
+
+int main(int argc, char **argv)
+{
+	printf("16x16, full maps %d bytes/frame, %d bytes/s at %d fps\n", NAIVE, NAIVE * FPS, FPS);
+
+	bench("chase", chase);
+	bench("toggles", toggles);
+	bench("playhead", playhead);
+	bench("rain", rain);
+	bench("meters", meters);
+	bench("scroll", scroll);
+	bench("life", life);
+	bench("noise", noise);
+
+	return 0;
+}
@@ -0,0 +1,190 @@
+/************************************************************************
+key latency histograms
+*************************************************************************
+puts a grid in key mode 2, where every key event carries the key_clock
+time (16us units) of the scan tick that saw its edge and of its write to
+the ft245, and sorts what arrives into three histograms:
+
+  press      scan tick to ft245, the scan, queueing and output loop
+  release    the same plus the debounce count
+  usb        ft245 to this read(), relative to the quickest event seen.
+             the two clocks drift apart slowly, so keep runs short
+
+usage: keylat [-n events] [-t seconds] <device>
+
+stops after that many events or seconds (default: until ^C), then sets
+key mode 0 again.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+#include "mk.h"
+
+#define WRAP_US (65536LL * 16)		// key_clock range
+
+static volatile sig_atomic_t stop;
+
+static int64_t now_us(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (int64_t)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+
+// ===============================================================
+class histogram {
+public:
+	histogram(const char *name) : name(name) {}
+
+	void add(int64_t us) { samples.push_back(us); }
+
+	// power of two buckets, 16us up
+	void print(void)
+	{
+		uint32_t bucket[24], i, n, top, bar;
+		int64_t lo;
+
+		printf("%s: %zu events", name, samples.size());
+		if(samples.empty()) { printf("\n\n"); return; }
+
+		std::sort(samples.begin(), samples.end());
+		n = samples.size();
+		printf(", min %lld  median %lld  99%% %lld  max %lld us\n", (long long)samples[0],
+			(long long)samples[n / 2], (long long)samples[n * 99 / 100], (long long)samples[n - 1]);
+
+		memset(bucket, 0, sizeof(bucket));
+		for(i=0;i<n;i++) {
+			for(bar=0;bar<23 && samples[i] >= (16LL << bar);bar++);
+			bucket[bar]++;
+		}
+		for(top=0,i=0;i<24;i++) top = std::max(top, bucket[i]);
+
+		for(i=0;i<24;i++) {
+			if(!bucket[i]) continue;
+			lo = i ? 16LL << (i - 1) : 0;
+			printf("  %8lld us  %6u %5.1f%%  ", (long long)lo, bucket[i], 100.0 * bucket[i] / n);
+			for(bar=(bucket[i] * 40 + top - 1) / top;bar--;) putchar('#');
+			putchar('\n');
+		}
+		putchar('\n');
+	}
+
+private:
+	const char *name;
+	std::vector<int64_t> samples;
+};
+
+
+// ===============================================================
+class latency : public mk::handler {
+public:
+	latency(void) : press("press"), release("release"), usb("usb"), events(0), synced(false) {}
+
+	void key_stamped(uint8_t x, uint8_t y, bool down, uint16_t sampled, uint16_t sent)
+	{
+		int64_t device;
+
+		(down ? press : release).add((uint16_t)(sent - sampled) * 16LL);
+
+		// sent on a clock that wraps every second: the wrap nearest to
+		// where the host clock says it should be
+		device = sent * 16LL;
+		if(synced) device += (last_device + (arrived - last_arrived) - device + WRAP_US / 2) / WRAP_US * WRAP_US;
+		offsets.push_back(arrived - device);
+		last_device = device;
+		last_arrived = arrived;
+		synced = true;
+		events++;
+	}
+
+	void finish(void)
+	{
+		int64_t quickest;
+
+		if(!offsets.empty()) {
+			quickest = *std::min_element(offsets.begin(), offsets.end());
+			for(size_t i=0;i<offsets.size();i++) usb.add(offsets[i] - quickest);
+		}
+		press.print();
+		release.print();
+		usb.print();
+	}
+
+	histogram press, release, usb;
+	std::vector<int64_t> offsets;
+	int64_t arrived, last_arrived, last_device;
+	uint32_t events;
+	bool synced;
+};
+
+static void interrupted(int sig)
+{
+	stop = 1;
+}
+
+
+// ===============================================================
+int main(int argc, char **argv)
+{
+	uint8_t buf[4096], out[16];
+	mk::writer w(out, sizeof(out));
+	mk::reader r;
+	latency l;
+	struct termios t;
+	struct pollfd p;
+	uint32_t max_events = 0;
+	int64_t until = 0;
+	ssize_t n;
+	int arg, fd;
+
+	for(arg=1;arg<argc && argv[arg][0] == '-';arg++) {
+		if(!strcmp(argv[arg], "-n") && arg + 1 < argc) max_events = atoi(argv[++arg]);
+		else if(!strcmp(argv[arg], "-t") && arg + 1 < argc) until = now_us() + atof(argv[++arg]) * 1e6;
+		else break;
+	}
+	if(argc - arg != 1) {
+		fprintf(stderr, "usage: keylat [-n events] [-t seconds] <device>\n");
+		return 2;
+	}
+
+	fd = open(argv[arg], O_RDWR | O_NOCTTY);
+	if(fd < 0) { perror(argv[arg]); return 2; }
+	if(!tcgetattr(fd, &t)) {
+		cfmakeraw(&t);
+		tcsetattr(fd, TCSANOW, &t);
+	}
+
+	signal(SIGINT, interrupted);
+	signal(SIGTERM, interrupted);
+
+	w.key_mode(2);
+	if(!w.flush(fd)) { perror("write"); return 2; }
+
+	p.fd = fd;
+	p.events = POLLIN;
+	while(!stop && (!max_events || l.events < max_events) && (!until || now_us() < until)) {
+		if(poll(&p, 1, 100) <= 0) continue;
+		n = read(fd, buf, sizeof(buf));
+		if(n <= 0) break;
+		l.arrived = now_us();
+		r.parse(buf, n, l);
+	}
+
+	w.key_mode(0);
+	w.flush(fd);
+	close(fd);
+
+	l.finish();
+	return 0;
+}
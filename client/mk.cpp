@@ -0,0 +1,519 @@
+/************************************************************************
+mk serial protocol, host side, see mk.h
+*/
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "mk.h"
+
+namespace mk {
+
+const uint8_t packet_length[256] = {
+	1,1,33,1, 4,1,3,1,3,1, 1,0,0,5,2,1,		// 0x00 sys
+	3,3, 1,1,11,4,4,2,4,2,35,7,7,0,0,0,		// 0x10 led, 0x18 levels (default)
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	1,2,2,0,0,0,0,0,0,0,0,0,0,0,0,0,		// 0x80 tilt
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
+};
+
+const uint8_t event_length[256] = {
+	3,33,0,3,0,0,28,51,0,0,0,0,0,0,0,0,		// 0x00 sys
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	3,3,4,4,7,7,0,0,0,0,0,0,0,0,0,0,		// 0x20 keys, 0x22 key rows, 0x24 stamped keys
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	3,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,		// 0x50 encoders
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,8,0,0,0,0,0,0,0,0,0,0,0,0,0,0,		// 0x81 tilt
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
+};
+
+
+// writer
+// ===============================================================
+uint8_t *writer::room(uint8_t n)
+{
+	uint8_t *p;
+
+	if(cap - len < n) return 0;
+	p = buf + len;
+	len += n;
+	return p;
+}
+
+bool writer::set(uint8_t x, uint8_t y, bool on)
+{
+	uint8_t *p = room(3);
+
+	if(!p) return false;
+	p[0] = on ? 0x11 : 0x10;
+	p[1] = x;
+	p[2] = y;
+	return true;
+}
+
+bool writer::all(bool on)
+{
+	uint8_t *p = room(1);
+
+	if(!p) return false;
+	p[0] = on ? 0x13 : 0x12;
+	return true;
+}
+
+bool writer::map(uint8_t x, uint8_t y, const uint8_t rows[8])
+{
+	uint8_t *p = room(11);
+
+	if(!p) return false;
+	p[0] = 0x14;
+	p[1] = x;
+	p[2] = y;
+	memcpy(p + 3, rows, 8);
+	return true;
+}
+
+bool writer::row(uint8_t x, uint8_t y, uint8_t bits)
+{
+	uint8_t *p = room(4);
+
+	if(!p) return false;
+	p[0] = 0x15;
+	p[1] = x;
+	p[2] = y;
+	p[3] = bits;
+	return true;
+}
+
+bool writer::col(uint8_t x, uint8_t y, uint8_t bits)
+{
+	uint8_t *p = room(4);
+
+	if(!p) return false;
+	p[0] = 0x16;
+	p[1] = x;
+	p[2] = y;
+	p[3] = bits;
+	return true;
+}
+
+bool writer::intensity(uint8_t level)
+{
+	uint8_t *p = room(2);
+
+	if(!p) return false;
+	p[0] = 0x17;
+	p[1] = level;
+	return true;
+}
+
+// frames
+// ===============================================================
+// rows, cols and sets all write the new state, so a quadrant change is
+// a cover of its changed leds: rows and cols 4 bytes, sets 3, or one
+// 11 byte map for the lot. with the rows fixed each col is its own
+// choice, so trying all 256 row sets finds the cheapest. an all0/all1
+// first is worth it when it leaves less to cover.
+struct cover {
+	uint8_t rows, cols;			// bit per row/col written
+	uint8_t bytes;				// 11: map instead
+};
+
+static uint8_t quadrant_rows(const uint16_t *f, uint8_t qx, uint8_t qy, uint8_t r)
+{
+	return f[qy + r] >> qx;
+}
+
+static cover plan(const uint8_t base[8], const uint16_t next[16], uint8_t qx, uint8_t qy)
+{
+	uint8_t d[8], dc[8], r, c, n, cols, cost;
+	uint16_t rows;
+	cover best;
+
+	memset(dc, 0, sizeof(dc));
+	for(r=0;r<8;r++) {
+		d[r] = base[r] ^ quadrant_rows(next, qx, qy, r);
+		for(c=0;c<8;c++) dc[c] |= ((d[r] >> c) & 1) << r;
+	}
+
+	best.rows = best.cols = 0;
+	best.bytes = 11;
+	for(rows=0;rows<256;rows++) {
+		cost = 4 * __builtin_popcount(rows);
+		cols = 0;
+		for(c=0;c<8 && cost<best.bytes;c++) {
+			n = __builtin_popcount(dc[c] & ~rows);
+			if(n > 1) { cost += 4; cols |= 1 << c; }
+			else cost += 3 * n;
+		}
+		if(cost < best.bytes) {
+			best.rows = rows;
+			best.cols = cols;
+			best.bytes = cost;
+		}
+	}
+	return best;
+}
+
+void writer::quadrant(const uint8_t *base, const uint16_t next[16], uint8_t qx, uint8_t qy)
+{
+	uint8_t rows[8], r, c, bits;
+	cover p = plan(base, next, qx, qy);
+
+	for(r=0;r<8;r++) rows[r] = quadrant_rows(next, qx, qy, r);
+
+	if(p.bytes == 11) {
+		map(qx, qy, rows);
+		return;
+	}
+	for(r=0;r<8;r++)
+		if(p.rows & (1 << r)) row(qx, qy + r, rows[r]);
+	for(c=0;c<8;c++) {
+		if(!(p.cols & (1 << c))) continue;
+		for(bits=r=0;r<8;r++) bits |= ((rows[r] >> c) & 1) << r;
+		col(qx + c, qy, bits);
+	}
+	for(r=0;r<8;r++) {
+		if(p.rows & (1 << r)) continue;
+		for(c=0;c<8;c++)
+			if(((base[r] ^ rows[r]) & ~p.cols) & (1 << c)) set(qx + c, qy + r, (rows[r] >> c) & 1);
+	}
+}
+
+bool writer::frame(const uint16_t last[16], const uint16_t next[16], uint8_t size_x, uint8_t size_y)
+{
+	static const uint8_t fill[3] = { 0, 0x00, 0xff };
+	uint8_t base[3][4][8], qx, qy, q, r, b, best;
+	uint32_t bytes[3];
+
+	// 0: from last, 1: after all0, 2: after all1
+	for(b=0;b<3;b++) {
+		bytes[b] = b ? 1 : 0;
+		for(q=0,qy=0;qy<size_y;qy+=8) {
+			for(qx=0;qx<size_x;qx+=8,q++) {
+				for(r=0;r<8;r++) base[b][q][r] = b ? fill[b] : quadrant_rows(last, qx, qy, r);
+				bytes[b] += plan(base[b][q], next, qx, qy).bytes;
+			}
+		}
+	}
+	for(best=0,b=1;b<3;b++) if(bytes[b] < bytes[best]) best = b;
+
+	if(cap - len < bytes[best]) return false;
+
+	if(best) all(best == 2);
+	for(q=0,qy=0;qy<size_y;qy+=8)
+		for(qx=0;qx<size_x;qx+=8,q++)
+			quadrant(base[best][q], next, qx, qy);
+	return true;
+}
+
+bool writer::set_level(uint8_t x, uint8_t y, uint8_t level)
+{
+	uint8_t *p = room(4);
+
+	if(!p) return false;
+	p[0] = 0x18;
+	p[1] = x;
+	p[2] = y;
+	p[3] = level;
+	return true;
+}
+
+bool writer::all_level(uint8_t level)
+{
+	uint8_t *p = room(2);
+
+	if(!p) return false;
+	p[0] = 0x19;
+	p[1] = level;
+	return true;
+}
+
+// two leds a byte, the lower x in the high nibble
+bool writer::map_level(uint8_t x, uint8_t y, const uint8_t levels[64])
+{
+	uint8_t *p = room(35), i;
+
+	if(!p) return false;
+	p[0] = 0x1a;
+	p[1] = x;
+	p[2] = y;
+	for(i=0;i<32;i++) p[i+3] = levels[i*2] << 4 | (levels[i*2+1] & 0x0f);
+	return true;
+}
+
+bool writer::row_level(uint8_t x, uint8_t y, const uint8_t levels[8])
+{
+	uint8_t *p = room(7), i;
+
+	if(!p) return false;
+	p[0] = 0x1b;
+	p[1] = x;
+	p[2] = y;
+	for(i=0;i<4;i++) p[i+3] = levels[i*2] << 4 | (levels[i*2+1] & 0x0f);
+	return true;
+}
+
+bool writer::col_level(uint8_t x, uint8_t y, const uint8_t levels[8])
+{
+	uint8_t *p = room(7), i;
+
+	if(!p) return false;
+	p[0] = 0x1c;
+	p[1] = x;
+	p[2] = y;
+	for(i=0;i<4;i++) p[i+3] = levels[i*2] << 4 | (levels[i*2+1] & 0x0f);
+	return true;
+}
+
+bool writer::query(void)
+{
+	static const uint8_t p[1] = { 0x00 };
+
+	return raw(p);
+}
+
+bool writer::query_id(void)
+{
+	static const uint8_t p[1] = { 0x01 };
+
+	return raw(p);
+}
+
+bool writer::grid_size(void)
+{
+	static const uint8_t p[1] = { 0x05 };
+
+	return raw(p);
+}
+
+bool writer::counters(void)
+{
+	static const uint8_t p[1] = { 0x09 };
+
+	return raw(p);
+}
+
+bool writer::schedule(void)
+{
+	static const uint8_t p[1] = { 0x0a };
+
+	return raw(p);
+}
+
+bool writer::scan(uint8_t fast, uint8_t idle, uint16_t hold)
+{
+	uint8_t p[5] = { 0x0d, fast, idle, (uint8_t)hold, (uint8_t)(hold >> 8) };
+
+	return raw(p);
+}
+
+bool writer::key_mode(uint8_t mode)
+{
+	uint8_t p[2] = { 0x0e, mode };
+
+	return raw(p);
+}
+
+bool writer::tilt(uint8_t n, bool on)
+{
+	uint8_t p[2] = { (uint8_t)(on ? 0x81 : 0x82), n };
+
+	return raw(p);
+}
+
+bool writer::raw(const uint8_t *packet)
+{
+	uint8_t n = packet_length[packet[0]], *p;
+
+	if(!n || !(p = room(n))) return false;
+	memcpy(p, packet, n);
+	return true;
+}
+
+bool writer::flush(int fd)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while(done < len) {
+		n = write(fd, buf + done, len - done);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0) {
+			memmove(buf, buf + done, len - done);
+			len -= done;
+			return false;
+		}
+		done += n;
+	}
+	len = 0;
+	return true;
+}
+
+
+// reader
+// ===============================================================
+// little endian, as the firmware sends them
+static uint16_t get16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+	return get16(p) | (uint32_t)get16(p + 2) << 16;
+}
+
+void reader::reset(void)
+{
+	carry_len = 0;
+	memset(keys, 0, sizeof(keys));
+}
+
+void reader::event(const uint8_t *p, handler &h)
+{
+	uint16_t now, changed;
+	uint8_t i, x, y;
+	char name[33];
+	counters c;
+	phase ph[phases];
+
+	switch(p[0]) {
+	case 0x00:
+		h.query(p[1], p[2]);
+		break;
+	case 0x01:
+		memcpy(name, p + 1, 32);
+		name[32] = 0;
+		h.id(name);
+		break;
+	case 0x03:
+		h.grid_size(p[1], p[2]);
+		break;
+	case 0x06:
+		c.rx_bytes = get32(p + 1);
+		c.rx_packets = get32(p + 5);
+		c.rx_resyncs = get16(p + 9);
+		c.rx_timeouts = get16(p + 11);
+		c.rx_starved = get16(p + 13);
+		c.output_high = p[15];
+		c.output_dropped = get16(p + 16);
+		c.display_refreshes = get16(p + 18);
+		c.scans_per_second = get16(p + 20);
+		c.loops_per_second = get32(p + 22);
+		c.aux_dropped = get16(p + 26);
+		h.counters(c);
+		break;
+	case 0x07:
+		for(i=0;i<phases;i++) {
+			ph[i].slice = p[1 + i*10];
+			ph[i].deadline = p[2 + i*10];
+			ph[i].wait = get16(p + 3 + i*10);
+			ph[i].run = get16(p + 5 + i*10);
+			ph[i].misses = get16(p + 7 + i*10);
+			ph[i].overruns = get16(p + 9 + i*10);
+		}
+		h.schedule(ph);
+		break;
+	case 0x20:
+	case 0x21:
+		x = p[1] & 0x0f;
+		y = p[2] & 0x0f;
+		if(p[0] & 1) keys[y] |= 1 << x;
+		else keys[y] &= ~(1 << x);
+		h.key(p[1], p[2], p[0] & 1);
+		break;
+	case 0x24:
+	case 0x25:
+		x = p[1] & 0x0f;
+		y = p[2] & 0x0f;
+		if(p[0] & 1) keys[y] |= 1 << x;
+		else keys[y] &= ~(1 << x);
+		h.key_stamped(p[1], p[2], p[0] & 1, p[3] | p[4] << 8, p[5] | p[6] << 8);
+		break;
+
+	// 8 keys from x,y along the row (0x22) or down the column (0x23)
+	case 0x22:
+		x = p[1] & 0x0f;
+		y = p[2] & 0x0f;
+		now = (uint16_t)p[3] << x;
+		changed = (keys[y] ^ now) & (0xff << x);
+		keys[y] ^= changed;
+		for(i=0;i<8 && x+i<16;i++)
+			if(changed & (1 << (x+i))) h.key(x+i, y, now & (1 << (x+i)));
+		break;
+	case 0x23:
+		x = p[1] & 0x0f;
+		y = p[2] & 0x0f;
+		for(i=0;i<8 && y+i<16;i++) {
+			if(((keys[y+i] >> x) & 1) == ((p[3] >> i) & 1)) continue;
+			keys[y+i] ^= 1 << x;
+			h.key(x, y+i, (p[3] >> i) & 1);
+		}
+		break;
+
+	case 0x50:
+		h.encoder(p[1], (int8_t)p[2]);
+		break;
+	case 0x81:
+		h.tilt(p[1], (int16_t)(p[2] | p[3] << 8), (int16_t)(p[4] | p[5] << 8));
+		break;
+	}
+}
+
+void reader::parse(const uint8_t *buf, size_t n, handler &h)
+{
+	size_t len, take;
+
+	// finish the packet the last read cut off
+	if(carry_len) {
+		len = event_length[carry[0]];
+		take = len - carry_len < n ? len - carry_len : n;
+		memcpy(carry + carry_len, buf, take);
+		carry_len += take;
+		buf += take;
+		n -= take;
+		if(carry_len < len) return;
+		event(carry, h);
+		carry_len = 0;
+	}
+
+	while(n) {
+		len = event_length[buf[0]];
+		if(!len) {
+			h.unknown(buf[0]);
+			buf++;
+			n--;
+			continue;
+		}
+		if(len > n) {
+			memcpy(carry, buf, n);
+			carry_len = n;
+			return;
+		}
+		event(buf, h);
+		buf += len;
+		n -= len;
+	}
+}
+
+}
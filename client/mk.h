@@ -0,0 +1,171 @@
+/************************************************************************
+mk serial protocol, host side
+*************************************************************************
+encodes led and system packets for the firmwares in ../firmware and
+decodes what they send back.
+
+  mk::writer  packs whole packets into a buffer the caller owns, many
+              per write() to the ft245 so the device byte rate is the
+              limit, not the syscall rate. nothing is allocated.
+              frame() picks the cheapest packets for a frame change,
+              see bench.cpp for what that saves over full maps.
+  mk::reader  walks bytes as read() returned them and hands each whole
+              packet to a mk::handler, decoded in place. only a packet
+              split across two reads is copied, into a 51 byte carry.
+
+x and y are grid coordinates (0-15), levels 0-15. the 0x18-0x1c level
+packets need the default firmware, the tilt packets the tilt ones: the
+others skip those types a byte at a time.
+
+	uint8_t buf[4096];
+	mk::writer w(buf, sizeof(buf));
+	w.all(0);
+	for(...) w.set(x, y, 1);
+	w.flush(fd);
+*/
+
+#ifndef __MK_H__
+#define __MK_H__
+
+#include <stddef.h>
+#include <inttypes.h>
+
+namespace mk {
+
+// host to device lengths by type byte, as packet_length[] in mk.c
+// (all variants together), 0 for types no firmware knows
+extern const uint8_t packet_length[256];
+
+// device to host lengths by type byte, 0 for types no firmware sends
+extern const uint8_t event_length[256];
+
+
+// the firmware's counters, see _SYS_REPORT_COUNTERS in mk.c. the per
+// second rates cover the last whole second, the rest run from boot and
+// wrap; rx_timeouts stays 0 on default, aux_dropped without tilt
+struct counters {
+	uint32_t rx_bytes, rx_packets;
+	uint16_t rx_resyncs, rx_timeouts, rx_starved;
+	uint8_t output_high;
+	uint16_t output_dropped;
+	uint16_t display_refreshes;
+	uint16_t scans_per_second;
+	uint32_t loops_per_second;
+	uint16_t aux_dropped;			// tilt packets lost to a full aux_buffer
+};
+
+// one main loop phase, see _SYS_REPORT_SCHEDULE in mk.c: keys, rx,
+// refresh, aux, output. 16us units, slice 0 has no limit. wait and run
+// are the longest since the last report, misses and overruns from boot
+const uint8_t phases = 5;
+struct phase {
+	uint8_t slice, deadline;
+	uint16_t wait, run;
+	uint16_t misses, overruns;
+};
+
+
+// ===============================================================
+class writer {
+public:
+	writer(uint8_t *buf, size_t size) : buf(buf), cap(size), len(0) {}
+
+	// each returns false and writes nothing once the packet no longer
+	// fits, flush() and send it again
+	bool set(uint8_t x, uint8_t y, bool on);
+	bool all(bool on);
+	bool map(uint8_t x, uint8_t y, const uint8_t rows[8]);	// bit i = x+i
+	bool row(uint8_t x, uint8_t y, uint8_t bits);
+	bool col(uint8_t x, uint8_t y, uint8_t bits);
+	bool intensity(uint8_t level);
+
+	// the fewest bytes of set, row, col, map and all packets that turn
+	// the leds from last to next, frames as rows[y] bit x. false and
+	// nothing written if they do not all fit
+	bool frame(const uint16_t last[16], const uint16_t next[16], uint8_t size_x, uint8_t size_y);
+
+	bool set_level(uint8_t x, uint8_t y, uint8_t level);
+	bool all_level(uint8_t level);
+	bool map_level(uint8_t x, uint8_t y, const uint8_t levels[64]);	// [y*8+x]
+	bool row_level(uint8_t x, uint8_t y, const uint8_t levels[8]);
+	bool col_level(uint8_t x, uint8_t y, const uint8_t levels[8]);
+
+	bool query(void);
+	bool query_id(void);
+	bool grid_size(void);
+	bool counters(void);
+	bool schedule(void);
+	bool key_mode(uint8_t mode);			// 1: row bitmaps, 2: stamped keys, see reader
+
+	// timer0 compares while keys are busy and once idle, and the scans
+	// at fast after the last busy one, see _SYS_SET_SCAN in mk.c
+	bool scan(uint8_t fast, uint8_t idle, uint16_t hold);
+	bool tilt(uint8_t n, bool on);
+
+	// any packet by type, length from packet_length[]
+	bool raw(const uint8_t *packet);
+
+	const uint8_t *data(void) const { return buf; }
+	size_t size(void) const { return len; }
+	void clear(void) { len = 0; }
+
+	// writes everything queued, returns false on a write error with
+	// what is left still queued
+	bool flush(int fd);
+
+private:
+	uint8_t *room(uint8_t n);
+	void quadrant(const uint8_t *base, const uint16_t next[16], uint8_t qx, uint8_t qy);
+
+	uint8_t *buf;
+	size_t cap, len;
+};
+
+
+// ===============================================================
+class handler {
+public:
+	virtual ~handler() {}
+
+	// 0x20/0x21, and 0x22/0x23 row bitmaps expanded to the keys that
+	// changed since the last report
+	virtual void key(uint8_t x, uint8_t y, bool down) {}
+
+	// 0x24/0x25 in key mode 2: when the scan saw the edge and when the
+	// event went to the ft245, in 16us units that wrap at 16 bits
+	virtual void key_stamped(uint8_t x, uint8_t y, bool down, uint16_t sampled, uint16_t sent) { key(x, y, down); }
+
+	virtual void encoder(uint8_t n, int8_t delta) {}			// 0x50
+	virtual void tilt(uint8_t n, int16_t x, int16_t y) {}		// 0x81
+	virtual void query(uint8_t section, uint8_t count) {}		// 0x00
+	virtual void id(const char *name) {}						// 0x01, up to 32 chars
+	virtual void grid_size(uint8_t x, uint8_t y) {}				// 0x03
+	virtual void counters(const mk::counters &c) {}				// 0x06
+	virtual void schedule(const mk::phase p[phases]) {}			// 0x07
+
+	// bytes no packet starts with, skipped one at a time
+	virtual void unknown(uint8_t b) {}
+};
+
+class reader {
+public:
+	reader(void) : carry_len(0) { reset(); }
+
+	// whole packets in buf go to h, a packet cut off at the end waits
+	// for the next call
+	void parse(const uint8_t *buf, size_t n, handler &h);
+
+	// forget the partial packet and the key state rows are compared to
+	void reset(void);
+
+private:
+	void event(const uint8_t *p, handler &h);
+
+	uint8_t carry[51];
+	uint8_t carry_len;
+	uint16_t keys[16];			// [y] bit x, as rows and key events left them
+};
+
+}
+
+#endif
@@ -0,0 +1,113 @@
+
+#include <inttypes.h>
+#include "button.h"
+
+
+// release counters are vertical: plane i holds bit i of the count for all
+// 8 keys of a row, enough planes to hold kButtonUpDefaultDebounceCount.
+#if kButtonUpDefaultDebounceCount < 2
+#define kButtonDebouncePlanes 1
+#elif kButtonUpDefaultDebounceCount < 4
+#define kButtonDebouncePlanes 2
+#elif kButtonUpDefaultDebounceCount < 8
+#define kButtonDebouncePlanes 3
+#elif kButtonUpDefaultDebounceCount < 16
+#define kButtonDebouncePlanes 4
+#elif kButtonUpDefaultDebounceCount < 32
+#define kButtonDebouncePlanes 5
+#elif kButtonUpDefaultDebounceCount < 64
+#define kButtonDebouncePlanes 6
+#elif kButtonUpDefaultDebounceCount < 128
+#define kButtonDebouncePlanes 7
+#else
+#define kButtonDebouncePlanes 8
+#endif
+
+
+uint8_t button_current[BUTTON_ROWS], 
+	  button_state[BUTTON_ROWS];
+
+static uint8_t button_count[kButtonDebouncePlanes][BUTTON_ROWS];
+
+
+/***************************************************************************************************
+ *
+ * DESCRIPTION: initializes all button debouncing variables.
+ *
+ * ARGUMENTS:
+ *
+ * RETURNS:
+ *
+ * NOTES:       
+ *
+ ****************************************************************************************************/
+
+void buttonInit(void)
+{
+    uint8_t i, j;
+
+    for (i = 0; i < BUTTON_ROWS; i++) {
+        button_current[i] = 0x00;
+        button_state[i] = 0x00;
+        for (j = 0; j < kButtonDebouncePlanes; j++)
+            button_count[j][i] = 0x00;
+    }
+}
+
+
+/***************************************************************************************************
+ *
+ * DESCRIPTION: debounces a whole row of physical button states at once and reports which debounced
+ *              states changed.
+ *
+ * ARGUMENTS:   row -     the row of buttons to be debounced.
+ *              current - physical button state of the row, one bit per column, 1 = depressed.
+ *
+ * RETURNS:     bitmap of buttons whose debounced state in button_state changed.
+ *
+ * NOTES:       presses are reported immediately. a release is reported once the button has stayed
+ *              up for kButtonUpDefaultDebounceCount further scans of its row; pressing it again in
+ *              the meantime pauses the count and releasing restarts it, like the per-button
+ *              counters this replaces.
+ *
+ ****************************************************************************************************/
+
+uint8_t buttonScan(uint8_t row, uint8_t current)
+{
+    uint8_t changed, differ, pressed, counting, borrow, count, i;
+
+    changed = current ^ button_current[row];           // physical state moved since the last scan
+    differ = current ^ button_state[row];              // physical state disagrees with the debounced one
+    button_current[row] = current;
+
+    pressed = changed & differ & current;              // new presses go out right away
+    button_state[row] |= pressed;
+
+    borrow = changed & differ & ~current;              // new releases (re)load the counter
+    for (i = 0; i < kButtonDebouncePlanes; i++) {
+        if (kButtonUpDefaultDebounceCount & (1 << i))
+            button_count[i][row] |= borrow;
+        else
+            button_count[i][row] &= ~borrow;
+    }
+
+    count = 0;                                         // steady releases with a running counter
+    for (i = 0; i < kButtonDebouncePlanes; i++)        // count down by one
+        count |= button_count[i][row];
+    counting = ~changed & differ & count;
+
+    borrow = counting;
+    for (i = 0; i < kButtonDebouncePlanes; i++) {
+        count = button_count[i][row];
+        button_count[i][row] = count ^ borrow;
+        borrow &= ~count;
+    }
+
+    count = 0;                                         // and take the state of those reaching zero
+    for (i = 0; i < kButtonDebouncePlanes; i++)
+        count |= button_count[i][row];
+    counting &= ~count;
+    button_state[row] ^= counting;
+
+    return pressed | counting;
+}
@@ -23,6 +23,7 @@
 #define __BUTTON_H__
 
 #include <inttypes.h>
+#include "variant.h"
 
 #define kButtonEventQueueSize 32
 
@@ -32,20 +33,18 @@
 #define kButtonDownEvent 1
 #define kButtonUpEvent   0
 
-#define kButtonDownDefaultDebounceCount 1
-#define kButtonUpDefaultDebounceCount   4
+// kButtonDownDefaultDebounceCount, kButtonUpDefaultDebounceCount: config.h
+
+#define LOOPS_buttonScan 8, 8                          // most debounce planes, 1 << i, see button.c
 
 #define kButtonNewEvent   1
 #define kButtonNoEvent    0
 
-extern uint8_t button_current[32],             // bitmap of physical button state (depressed or released)
-             button_last[32],                // bitmap of physical button state last time buttons were read
-			button_state[32],              // bitmap of debounced button state
-   			button_debounce_count[32][8],   // debounce counters for each button
-             button_event[32];               // queued button events (kButtonDownEvent or kButtonDownEvent)
+extern uint8_t button_current[BUTTON_ROWS],             // bitmap of physical button state (depressed or released)
+			button_state[BUTTON_ROWS];              // bitmap of debounced button state
 
 void buttonInit(void);
-void buttonCheck(uint8_t row, uint8_t index);
+uint8_t buttonScan(uint8_t row, uint8_t current);
 
 
 #endif
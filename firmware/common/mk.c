@@ -0,0 +1,1679 @@
+/************************************************************************
+mk firmware
+*************************************************************************
+one source for every variant: each firmware folder builds it against
+its own config.h, see variant.h.
+adc - PORTF
+io - PORTA
+*/
+
+#define F_CPU 16000000UL
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include "port.h"
+#include "variant.h"
+#include "button.h"
+
+
+// protocol incoming
+#define _SYS_QUERY 0x00
+#define _SYS_QUERY_ID 0x01
+#define _SYS_WRITE_ID 0x02
+#define _SYS_GET_GRID_OFFSET 0x03
+#define _SYS_SET_GRID_OFFSET 0x04
+#define _SYS_GET_GRID_SIZE 0x05
+#define _SYS_SET_GRID_SIZE 0x06
+#define _SYS_SCAN_ADDR 0x07
+#define _SYS_SET_ADDR 0x08
+#define _SYS_GET_COUNTERS 0x09
+#define _SYS_GET_SCHEDULE 0x0A
+#define _SYS_SET_SCAN 0x0D
+#define _SYS_SET_KEY_MODE 0x0E
+#define _SYS_QUERY_VERSION 0x0F
+
+#define _LED_SET0 0x10
+#define _LED_SET1 0x11
+#define _LED_ALL0 0x12
+#define _LED_ALL1 0x13
+#define _LED_MAP 0x14
+#define _LED_ROW 0x15
+#define _LED_COL 0x16
+#define _LED_INT 0x17
+#define _LED_SETX 0x18
+#define _LED_ALLX 0x19
+#define _LED_MAPX 0x1A
+#define _LED_ROWX 0x1B
+#define _LED_COLX 0x1C
+
+#define _TILT_GET_STATE 0x80
+#define _TILT_SET_STATE_ON 0x81
+#define _TILT_SET_STATE_OFF 0x82
+
+
+// bytes of each packet by type, 0 for bytes no packet starts with
+const uint8_t packet_length[PACKET_TYPES] PROGMEM = {
+	1,1,33,1,4,1,3,1,3,1,1,0,0,5,2,1,
+#if VARIBRIGHT
+	3,3,1,1,11,4,4,2,4,2,35,7,7,0,0,0,
+#else
+	3,3,1,1,11,4,4,2,0,0,0,0,0,0,0,0,
+#endif
+#if PACKET_TYPES > 32
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	1,2,2,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0
+#endif
+};
+
+// protocol outgoing
+#define _SYS_QUERY_RESPONSE 0x00
+#define _SYS_ID 0x01
+#define _SYS_REPORT_GRID_OFFSET 0x02
+#define _SYS_REPORT_GRID_SIZE 0x03
+#define _SYS_FOUND_ADDR 0x04
+#define _SYS_REPORT_VERSION 0x05
+
+// reply to _SYS_GET_COUNTERS, little endian: rx bytes (4), rx packets (4),
+// rx resyncs, RX_TIMEOUT drops, rx passes cut short, output high water (1),
+// output drops, display refreshes, keypad scans in the last second, main
+// loop passes in the last second (4), tilt packets the aux interrupt
+// dropped with aux_buffer full (0 without tilt). all but the per second
+// two run from boot and wrap.
+#define _SYS_REPORT_COUNTERS 0x06
+
+// reply to _SYS_GET_SCHEDULE, for each main loop phase in PHASE_ order:
+// slice, deadline (16us units), then little endian the longest wait and
+// run since the last report, misses and overruns from boot, see the
+// scheduler below. the longest wait and run restart with each report.
+#define _SYS_REPORT_SCHEDULE 0x07
+
+// key rows, sent instead of per key events after _SYS_SET_KEY_MODE 1.
+// [type, x, y, bits]: bit i is the debounced state of key x+i (_KEY_ROW)
+// or y+i (_KEY_COL), 1 = down.
+#define _KEY_ROW 0x22
+#define _KEY_COL 0x23
+
+// key events with timestamps, sent instead of 0x20/0x21 after
+// _SYS_SET_KEY_MODE 2: [type, x, y, sampled lo, hi, sent lo, hi] in 16us
+// key_clock units. sampled is the scan tick that saw the edge (a release
+// is reported kButtonUpDefaultDebounceCount scans of its row later), sent
+// the time the packet reached the ft245.
+#define _KEY_UP_STAMPED 0x24
+#define _KEY_DOWN_STAMPED 0x25
+
+
+
+// eeprom locations
+#if AUX == AUX_TILT
+#define EEPROM_PORT_ENABLE 0
+#else
+#define EEPROM_NUM_GRIDS 0
+#define EEPROM_PORT_ENABLE 1
+#endif
+
+// tuning, the rest is in config.h
+#define OUTPUT_BUFFER_LENGTH 256
+#define STAMP_RING_LENGTH 32	// power of two, sent stamps waiting in output_buffer
+#define RATE_WINDOW 62500		// key_clock units in a second, for the per second counters
+#define RX_RING_LENGTH 128	// power of two
+#define RX_BURST 16			// most bytes taken per rx interrupt, ~600 cycles
+#define RX_POLL_RATE 79		// timer2 ctc at clk/8: 40us
+#define BAM_SLOT 2500		// timer1 ticks at clk/8 in a bam slot: 1.25ms, a max7219 scan at 800Hz
+#define BAM_PLANES 4		// slots in a bam period: 5ms, 200Hz
+#define AUX_BUFFER_LENGTH 32	// 4 tilt packets, power of two
+
+// main loop phases in the order a pass runs them, with the most time each
+// should run (slice) and may wait once due (deadline), in 16us units. keys
+// are due at the timer0 tick and miss when a tick goes unscanned, the
+// others are due when the pass starts. RX_SLICE is in config.h.
+#define PHASE_KEYS 0
+#define PHASE_RX 1
+#define PHASE_REFRESH 2
+#define PHASE_AUX 3
+#define PHASE_OUTPUT 4
+#define PHASES 5
+#define KEY_TICK(rate) (((uint16_t)(rate) + 1) << KEY_STAMP_SHIFT)	// timer0 period at a compare
+#define KEY_HOLD_MIN (8 * (kButtonDownDefaultDebounceCount + 1))	// scans, see _SYS_SET_SCAN
+#define KEY_RATE_MIN 1		// lowest timer0 compare _SYS_SET_SCAN takes
+#define SLICE_KEYS 4		// settle delays, the 8 clocks, debounce and events, one row runs whole
+#define SLICE_REFRESH 4		// rows to the drivers, the rest next pass
+#define SLICE_AUX 2			// aux packets, the rest next pass
+#define SLICE_OUTPUT 4		// bytes to the ft245, 8 between looks at the clock
+#define DEADLINE_RX (RX_RING_LENGTH / 16)	// the ring fills at ~1 byte/us
+#define DEADLINE_REFRESH (BAM_SLOT / 32)	// a bam slot
+#define DEADLINE_AUX 64
+#define DEADLINE_OUTPUT 16
+
+// worst case budget, checked by make budget: cycles each interrupt has
+// until its timer comes round again, and the most passes a function's
+// loops make, one bound per nesting level from the outside in. gcc's
+// loops for a shift by a variable count (1 << b) are levels too, and a
+// function gcc inlines brings its levels along, so some lists run past
+// the loops written out here
+#define BUDGET_TIMER0_COMP_vect ((KEY_RATE_MIN + 1) * KEY_PRESCALE)	// the fastest scan a host can ask for
+#if VARIBRIGHT
+#define BUDGET_TIMER1_COMPA_vect (BAM_SLOT * 8)
+#elif AUX != AUX_NONE
+#define BUDGET_TIMER1_COMPA_vect ((AUX_REFRESH_RATE + 1) * AUX_PRESCALE)
+#endif
+#if AUX == AUX_ENCODERS
+#define LOOPS_TIMER1_COMPA_vect 8
+#endif
+#define BUDGET_TIMER2_COMP_vect ((RX_POLL_RATE + 1) * 8)
+#define LOOPS_TIMER2_COMP_vect RX_BURST
+#define LOOPS_to_led 16
+#define LOOPS_to_all_led 8, 8		// bits, 1 << (7-i)
+#define LOOPS_rx_sys_query_id 32
+#define LOOPS_rx_sys_get_schedule PHASES
+#define LOOPS_keys_down BUTTON_ROWS
+#define LOOPS_rx_led_map 8, 4		// rows, planes
+#define LOOPS_transpose8 8, 4	// rows, swap_blocks
+#define LOOPS_swap_blocks 4
+#if VARIBRIGHT
+#define LOOPS_bam_scale BAM_PLANES
+#define LOOPS_led_level 4, 8		// planes, 1 << b
+#define LOOPS_led_all 4, 4, 8, 8	// planes, quadrants, rows, 1 << b
+#define LOOPS_rx_led_all0 LOOPS_led_all
+#define LOOPS_rx_led_all1 LOOPS_led_all
+#define LOOPS_rx_led_allx LOOPS_led_all
+#define LOOPS_rx_led_row 8, 4		// 1 << y and rows, planes
+#define LOOPS_rx_led_set0 8, 8		// 1 << y and led_level
+#define LOOPS_rx_led_set1 8, 8
+#define LOOPS_rx_led_setx 8, 8
+#define LOOPS_rx_led_col 4
+#define LOOPS_rx_led_mapx 8, 8, 4, 8	// columns, 1 << x and rows, led_level
+#define LOOPS_rx_led_rowx 8, 4, 8	// 1 << y and rows, led_level
+#define LOOPS_rx_led_colx 4, 8, 8	// rows, 1 << bit and led_level
+#else
+#define LOOPS_rx_led_all0 4, 8		// quadrants, rows
+#define LOOPS_rx_led_all1 4, 8
+#define LOOPS_quad_col_bits 8
+#endif
+
+
+
+static const uint8_t rev[] =
+{
+0x00, 0x80, 0x40, 0xC0, 0x20, 0xA0, 0x60, 0xE0, 0x10, 0x90, 0x50, 0xD0, 0x30, 0xB0, 0x70, 0xF0,
+0x08, 0x88, 0x48, 0xC8, 0x28, 0xA8, 0x68, 0xE8, 0x18, 0x98, 0x58, 0xD8, 0x38, 0xB8, 0x78, 0xF8,
+0x04, 0x84, 0x44, 0xC4, 0x24, 0xA4, 0x64, 0xE4, 0x14, 0x94, 0x54, 0xD4, 0x34, 0xB4, 0x74, 0xF4,
+0x0C, 0x8C, 0x4C, 0xCC, 0x2C, 0xAC, 0x6C, 0xEC, 0x1C, 0x9C, 0x5C, 0xDC, 0x3C, 0xBC, 0x7C, 0xFC,
+0x02, 0x82, 0x42, 0xC2, 0x22, 0xA2, 0x62, 0xE2, 0x12, 0x92, 0x52, 0xD2, 0x32, 0xB2, 0x72, 0xF2,
+0x0A, 0x8A, 0x4A, 0xCA, 0x2A, 0xAA, 0x6A, 0xEA, 0x1A, 0x9A, 0x5A, 0xDA, 0x3A, 0xBA, 0x7A, 0xFA,
+0x06, 0x86, 0x46, 0xC6, 0x26, 0xA6, 0x66, 0xE6, 0x16, 0x96, 0x56, 0xD6, 0x36, 0xB6, 0x76, 0xF6,
+0x0E, 0x8E, 0x4E, 0xCE, 0x2E, 0xAE, 0x6E, 0xEE, 0x1E, 0x9E, 0x5E, 0xDE, 0x3E, 0xBE, 0x7E, 0xFE,
+0x01, 0x81, 0x41, 0xC1, 0x21, 0xA1, 0x61, 0xE1, 0x11, 0x91, 0x51, 0xD1, 0x31, 0xB1, 0x71, 0xF1,
+0x09, 0x89, 0x49, 0xC9, 0x29, 0xA9, 0x69, 0xE9, 0x19, 0x99, 0x59, 0xD9, 0x39, 0xB9, 0x79, 0xF9,
+0x05, 0x85, 0x45, 0xC5, 0x25, 0xA5, 0x65, 0xE5, 0x15, 0x95, 0x55, 0xD5, 0x35, 0xB5, 0x75, 0xF5,
+0x0D, 0x8D, 0x4D, 0xCD, 0x2D, 0xAD, 0x6D, 0xED, 0x1D, 0x9D, 0x5D, 0xDD, 0x3D, 0xBD, 0x7D, 0xFD,
+0x03, 0x83, 0x43, 0xC3, 0x23, 0xA3, 0x63, 0xE3, 0x13, 0x93, 0x53, 0xD3, 0x33, 0xB3, 0x73, 0xF3,
+0x0B, 0x8B, 0x4B, 0xCB, 0x2B, 0xAB, 0x6B, 0xEB, 0x1B, 0x9B, 0x5B, 0xDB, 0x3B, 0xBB, 0x7B, 0xFB,
+0x07, 0x87, 0x47, 0xC7, 0x27, 0xA7, 0x67, 0xE7, 0x17, 0x97, 0x57, 0xD7, 0x37, 0xB7, 0x77, 0xF7,
+0x0F, 0x8F, 0x4F, 0xCF, 0x2F, 0xAF, 0x6F, 0xEF, 0x1F, 0x9F, 0x5F, 0xDF, 0x3F, 0xBF, 0x7F, 0xFF
+};
+
+// how each 8x8 quadrant sits on the grid. row r, bit c of chain q (a
+// max7219 digit or a keypad register row) is the cell
+//   x = c ^ QUAD_BIT(q), y = r ^ QUAD_ROW(q)	QUAD_SWAP(q) 0
+//   x = r ^ QUAD_ROW(q), y = c ^ QUAD_BIT(q)	QUAD_SWAP(q) 0xff
+// new grids are all wired alike, so the lookups fold away. 40h tiles are
+// each turned to face the middle of the 2x2.
+#if ROTATE_40H
+static const uint8_t quad_swap[4] = { 0, 0xff, 0xff, 0 };
+static const uint8_t quad_row[4] = { 7, 0, 7, 0 };
+static const uint8_t quad_bit[4] = { 7, 7, 0, 0 };
+#define QUAD_SWAP(q) quad_swap[q]
+#define QUAD_ROW(q) quad_row[q]
+#define QUAD_BIT(q) quad_bit[q]
+#else
+#define QUAD_SWAP(q) 0xff
+#define QUAD_ROW(q) 7
+#define QUAD_BIT(q) 0
+#endif
+
+// globals
+volatile uint8_t port_enable;
+volatile uint8_t scan_keypads;
+volatile uint16_t key_clock;		// 16us units, moved on by timer0
+volatile uint16_t key_due;		// the first tick no scan has answered yet
+volatile uint8_t key_rate;		// timer0 compare from the next tick on
+
+volatile uint8_t rx_ring[RX_RING_LENGTH];
+volatile uint8_t rx_ring_write;		// usb rx interrupt only
+volatile uint8_t rx_ring_read;		// main loop only
+
+uint8_t output_buffer[OUTPUT_BUFFER_LENGTH];
+uint8_t output_write;
+uint8_t output_read;
+uint16_t output_dropped;		// packets that did not fit
+uint8_t output_high;			// most bytes ever queued
+uint8_t stamp_at[STAMP_RING_LENGTH];	// output_buffer index of each sent stamp to fill
+uint8_t stamp_write;
+uint8_t stamp_read;
+
+#if VARIBRIGHT
+volatile uint8_t bam_plane;			// plane the leds should show now, a slot each
+uint8_t bam_intensity[BAM_PLANES];	// max7219 intensity each plane shows at
+volatile uint8_t bam_due;			// bam_plane moved on, main loop reloads
+volatile uint16_t bam_frames;		// bam periods started
+volatile uint16_t bam_late;			// planes the main loop never got to
+#endif
+
+#if AUX == AUX_ENCODERS
+// aux (encoder) globals
+uint8_t n1, n2, n3, n4;
+
+char map[4][4] = { {0,1,-1,0}, {-1,0,0,1}, {1,0,0,-1}, {0,-1,1,0} };
+volatile uint8_t enc_now[8], enc_prev[8];
+volatile char enc_delta[8];
+uint8_t enc_next;			// encoder the main loop looks at first
+#endif
+
+#if AUX == AUX_TILT
+// tilt packets from the aux interrupt, moved to output_buffer by the main loop
+volatile uint8_t aux_buffer[AUX_BUFFER_LENGTH];
+volatile uint8_t aux_write;		// aux interrupt only
+volatile uint8_t aux_read;		// main loop only
+volatile uint16_t aux_dropped;
+
+volatile int16_t an[2][2];
+volatile int16_t a;
+volatile int16_t an_bucket[2][8];
+volatile uint8_t an_num;
+volatile uint8_t an_index;
+volatile int32_t an_accum[2];
+#endif
+
+
+// send packet to all led drivers
+// ===============================================================
+void to_all_led(char data1, char data2)
+{
+	uint8_t i;
+
+	PORT_CLR(PORTE, E1_LD);
+
+	for(i=0;i<8;i++) {
+		if(data1 & (1<<(7-i))) 
+			PORT_SET(PORTE, ALL_SER);
+		else
+			PORT_CLR(PORTE, ALL_SER);
+		
+		PORT_SET(PORTE, E0_CLK);
+		PORT_CLR(PORTE, E0_CLK);
+	}
+
+	for(i=0;i<8;i++) {
+		if(data2 & (1<<(7-i))) 
+			PORT_SET(PORTE, ALL_SER);
+		else
+			PORT_CLR(PORTE, ALL_SER);
+
+		PORT_SET(PORTE, E0_CLK);
+		PORT_CLR(PORTE, E0_CLK);
+	}
+
+	PORT_SET(PORTE, E1_LD); 
+}
+
+// update led drivers-- first byte to all, individual second bytes
+// ===============================================================
+// the bytes are bit-sliced first: slice[i] is the PORTE value carrying
+// bit 7-i of the address on every SER line, slice[8+i] bit 7-i of each
+// driver's data on its own SER line. shifting out is then two straight
+// writes per clock.
+void to_led(char data_all, char data1, char data2, char data3, char data4)
+{
+	uint8_t i, e, s;
+	uint8_t slice[16];
+
+	e = PORT_IN(PORTE) & ~(ALL_SER | E0_CLK | E1_LD);
+
+	for(i=0;i<8;i++) {
+		slice[i] = (data_all & 0x80) ? e | ALL_SER : e;
+		data_all <<= 1;
+
+		s = e;
+		if(data1 & 0x80) s |= E5_SER1;
+		if(data2 & 0x80) s |= E4_SER2;
+		if(data3 & 0x80) s |= E3_SER3;
+		if(data4 & 0x80) s |= E2_SER4;
+		slice[8+i] = s;
+		data1 <<= 1; data2 <<= 1; data3 <<= 1; data4 <<= 1;
+	}
+
+	for(i=0;i<16;i++) {
+		PORT_OUT(PORTE, slice[i]);
+		PORT_OUT(PORTE, slice[i] | E0_CLK);
+	}
+
+	PORT_OUT(PORTE, e);
+	PORT_OUT(PORTE, e | E1_LD);
+}
+
+
+// KEYPAD SCAN INT
+// ===============================================================
+// ===============================================================
+// the compare changes only here, with TCNT0 back at 0: a lower one set
+// mid tick could already be behind the count
+ISR(TIMER0_COMP_vect)
+{
+	key_clock += KEY_TICK(OCR0A);
+	TCNT0 = 0;
+	OCR0A = key_rate;
+	if(!scan_keypads) key_due = key_clock;
+	scan_keypads = 1;
+}
+
+#if VARIBRIGHT
+// BAM INT
+// ===============================================================
+// ===============================================================
+// bit angle modulation weighted by the max7219 intensity register: each
+// plane shows for one slot, at an intensity lighting about twice as long
+// as the plane below (duty (2n+1)/32), so 4 slots make a period (5ms,
+// 200Hz). a slot is at least one max7219 scan (800Hz typical) so every
+// digit gets each plane whole; a driver scanning slower than typical
+// still beats against the slots a little. with the planes taking turns,
+// level 15 lights at about half of what the other firmwares do. the main
+// loop does the shifting so to_led never races the keypad scan on PORTE.
+ISR(TIMER1_COMPA_vect)
+{
+	if(bam_due) bam_late++;
+
+	bam_plane = (bam_plane + 1) & (BAM_PLANES-1);
+	if(!bam_plane) bam_frames++;
+	bam_due = 1;
+}
+
+// intensities for _LED_INT: plane 3 takes the host's, each plane below
+// about half the duty of the one above, the lowest ones stopping at the
+// driver's dimmest
+static void bam_scale(uint8_t level)
+{
+	uint8_t i1, i2;
+
+	i2 = level + 1;
+	for(i1=BAM_PLANES;i1--;) {
+		bam_intensity[i1] = i2 ? i2 - 1 : 0;
+		i2 >>= 1;
+	}
+}
+#endif
+
+// USB RX INT
+// ===============================================================
+// ===============================================================
+// moves waiting ft245 bytes into rx_ring so the fifo keeps draining while
+// the main loop shifts leds or scans keys. portc has no pin change
+// interrupt, so RXF is polled from timer2.
+ISR(TIMER2_COMP_vect)
+{
+	uint8_t n, ddr, port;
+
+	if(PORT_IN(PINC) & C1_RXF) return;
+
+	ddr = PORT_IN(DDRD);			// the main loop may be mid-write
+	port = PORT_IN(PORTD);
+	PORT_OUT(DDRD, 0);
+	PORT_OUT(PORTD, 0);
+
+	for(n=0;n<RX_BURST && !(PORT_IN(PINC) & C1_RXF);n++) {
+		if((uint8_t)(rx_ring_write - rx_ring_read) == RX_RING_LENGTH) break;
+
+		PORT_CLR(PORTC, C3_RD);
+		_delay_us(0.25);			// rd to valid data
+		rx_ring[rx_ring_write & (RX_RING_LENGTH-1)] = PORT_IN(PIND);
+		rx_ring_write++;
+		PORT_SET(PORTC, C3_RD);
+	}
+
+	PORT_OUT(PORTD, port);
+	PORT_OUT(DDRD, ddr);
+}
+
+#if AUX == AUX_ENCODERS
+// AUX INT
+// ===============================================================
+// ===============================================================
+ISR(TIMER1_COMPA_vect)
+{
+	if(port_enable) {
+		n1 = PINA;
+		n2 = PINF;
+		
+		for(n3=0;n3<8;n3++) {
+			enc_now[n3] = (n1 & 1) | (n2 & 1)<<1;
+			enc_delta[n3] += map[enc_prev[n3]][enc_now[n3]];
+			enc_prev[n3] = enc_now[n3];
+			n1 >>= 1;
+			n2 >>= 1;
+		}
+	}
+	
+	TCNT1 = 0;
+}
+#endif
+
+#if AUX == AUX_TILT
+// AUX INT
+// ===============================================================
+// ===============================================================
+ISR(TIMER1_COMPA_vect)
+{
+	volatile uint8_t *p;
+
+	if(port_enable) {
+		an[an_num][1] = an[an_num][0];
+		an_accum[an_num] -= an_bucket[an_num][an_index];
+		a = (ADCW>>2) - 128;
+		an_bucket[an_num][an_index] = a;
+		an_accum[an_num] += a;
+		an[an_num][0] = an_accum[an_num] >> 3;
+
+		// send tilt,val via usb
+
+		if(an[an_num][0] != an[an_num][1]) {
+			if((uint8_t)(aux_write - aux_read) == AUX_BUFFER_LENGTH) aux_dropped++;
+			else {
+				p = aux_buffer + (aux_write & (AUX_BUFFER_LENGTH-1));
+				p[0] = 0x81;
+				p[1] = 0;
+				p[2] = an[0][0] & 0xff;
+				p[3] = an[0][0] >> 8;
+				p[4] = an[1][0] & 0xff;
+				p[5] = an[1][0] >> 8;
+				p[6] = 0;
+				p[7] = 0;
+				aux_write += 8;		// publish the whole packet
+			}
+		}
+
+		if(an_num==1) {
+			ADMUX = (1<<MUX0);
+			an_num = 0;
+			an_index = (an_index + 1) % 8;
+		}
+		else {
+			ADMUX = 0;
+			an_num = 1;
+		}
+
+		ADCSRA |= (1<<ADSC);		// start conversion
+	}
+
+	TCNT1 = 0;
+}
+#endif
+
+
+// main loop state
+uint8_t rx_count;
+uint8_t rx_length;
+uint8_t rx_type;
+uint16_t rx_started;	// pass that took the first byte of the packet in rx
+uint32_t rx_packets;	// handled
+uint16_t rx_resyncs;	// partial packets dropped on RX_TIMEOUT, bytes with no packet length
+uint32_t rx_bytes;		// taken from rx_ring
+uint16_t rx_timeouts;	// partial packets dropped on RX_TIMEOUT
+uint16_t rx_starved;	// passes cut off by RX_SLICE or a due scan with bytes still waiting
+uint16_t display_refreshes;	// passes that shifted rows out to the drivers
+uint16_t scans, scan_rate;	// keypad scans, and how many the last second had
+uint32_t loops, loop_rate;	// main loop passes, the same
+uint16_t rate_start;		// key_clock when this second began
+uint8_t rx[66];	// input buffer
+uint8_t usb_state, sleep_state;
+uint8_t key_mode;		// 1: report whole key rows, 2: stamped key events
+uint8_t display_dirty;	// rows (max7219 digits) changed since the last refresh
+#if VARIBRIGHT
+uint8_t plane[4][4][8];	// [bit][quadrant][row]: bit b of each led's level
+uint8_t bam_mixed;		// rows whose planes differ, reloaded every bam slot
+#else
+uint8_t display[4][8];
+#endif
+
+char id[32];
+
+uint8_t keypad_row;
+uint8_t key_fast, key_idle;	// compares while keys are busy and once they are idle
+uint16_t key_hold, key_left;	// scans at key_fast after the last busy one, and those left
+
+static const uint8_t phase_slice[PHASES] = { SLICE_KEYS, RX_SLICE, SLICE_REFRESH, SLICE_AUX, SLICE_OUTPUT };
+uint8_t phase_deadline[PHASES] = { KEY_TICK(KEY_REFRESH_RATE), DEADLINE_RX, DEADLINE_REFRESH, DEADLINE_AUX, DEADLINE_OUTPUT };	// keys: the tick, as the scan rate sets it
+uint16_t phase_wait[PHASES];	// longest since the last report
+uint16_t phase_run[PHASES];
+uint16_t phase_misses[PHASES];	// waits past the deadline
+uint16_t phase_overruns[PHASES];	// runs past the slice
+
+
+// output queue
+// ===============================================================
+// ===============================================================
+// the main loop is the only producer and consumer of output_buffer, the
+// indices wrap at 256 with uint8_t. a packet is queued whole or dropped
+// whole and counted, so the stream never carries a torn packet.
+static uint8_t output_room(uint8_t n)
+{
+	uint8_t used = output_write - output_read;
+
+	if(used + n > OUTPUT_BUFFER_LENGTH - 1) {	// one slot open: full != empty
+		output_dropped++;
+		return 0;
+	}
+	if(used + n > output_high) output_high = used + n;
+	return 1;
+}
+
+static void output_put(uint8_t b)
+{
+	output_buffer[output_write] = b;
+	output_write++;
+}
+
+static void output_put16(uint16_t v)
+{
+	output_put(v);
+	output_put(v >> 8);
+}
+
+// one key change as 0x20/0x21, or stamped in key mode 2. the sent stamp
+// is left for the output loop to fill in as the packet goes out.
+static void key_event(uint8_t down, uint8_t x, uint8_t y, uint16_t sampled)
+{
+	if(key_mode != 2) {
+		if(output_room(3)) {
+			output_put(down + 32);
+			output_put(x);
+			output_put(y);
+		}
+		return;
+	}
+
+	if((uint8_t)(stamp_write - stamp_read) == STAMP_RING_LENGTH) {
+		output_dropped++;
+		return;
+	}
+	if(!down) sampled -= (uint16_t)(kButtonUpDefaultDebounceCount * 8) * KEY_TICK(key_fast);	// debounced at the fast rate
+
+	if(output_room(7)) {
+		output_put(_KEY_UP_STAMPED + down);
+		output_put(x);
+		output_put(y);
+		output_put(sampled);
+		output_put(sampled >> 8);
+		stamp_at[stamp_write & (STAMP_RING_LENGTH-1)] = output_write;
+		stamp_write++;
+		output_put(0);
+		output_put(0);
+	}
+}
+
+// any key debounced down, a release still counting included, on any row
+// and not just the one this scan read
+static uint8_t keys_down(void)
+{
+	uint8_t i1, b;
+
+	b = 0;
+	for(i1=0;i1<BUTTON_ROWS;i1++) b |= button_state[i1];
+	return b;
+}
+
+
+// main loop scheduler
+// ===============================================================
+// ===============================================================
+// cooperative: each phase looks at the clock between its pieces of work
+// (rx packets, display rows, aux packets, output bytes 8 at a time) and
+// hands the cpu back once its slice is used or a key scan is due, which
+// a pass runs first; what is left waits for the next pass. so a led
+// flood holds a scan back by one packet's work, not by whatever the host
+// sent. the key scan is a keypad row and runs whole. phase_begin and
+// phase_end keep the jitter figures.
+static uint16_t sched_now(void)
+{
+	uint16_t t;
+
+	cli();
+	t = key_clock + ((uint16_t)TCNT0 << KEY_STAMP_SHIFT);
+	sei();
+	return t;
+}
+
+// phase p, due at due, starts: returns the start for phase_end
+static uint16_t phase_begin(uint8_t p, uint16_t due)
+{
+	uint16_t t, w;
+
+	t = sched_now();
+	w = t - due;
+	if(w > phase_wait[p]) phase_wait[p] = w;
+	if(w > phase_deadline[p]) phase_misses[p]++;
+	return t;
+}
+
+// phase p, started at start, should hand the cpu back
+static uint8_t phase_spent(uint8_t p, uint16_t start)
+{
+	return scan_keypads || (phase_slice[p] && (uint16_t)(sched_now() - start) >= phase_slice[p]);
+}
+
+static void phase_end(uint8_t p, uint16_t start)
+{
+	uint16_t r;
+
+	r = sched_now() - start;
+	if(r > phase_run[p]) phase_run[p] = r;
+	if(phase_slice[p] && r > phase_slice[p]) phase_overruns[p]++;
+}
+
+
+// init
+// ===============================================================
+// ===============================================================
+// ===============================================================
+void mk_init(void)
+{
+	uint8_t i1,i2;
+
+	// pin assignments
+	PORT_OUT(DDRE, 0xff);	// all output
+	PORT_OUT(DDRB, B4_A0 | B5_A1 | B6_A2); 
+	PORT_OUT(DDRC, C2_WR | C3_RD);
+	PORT_OUT(DDRD, 0);                                 			
+
+	PORT_OUT(PORTE, 0);
+	PORT_OUT(PORTB, 0); 
+	PORT_OUT(PORTD, 0);
+	PORT_SET(PORTC, C3_RD);	// rd idles high
+
+	// aux pin assignments
+	DDRA = 0;
+	DDRF = 0;
+	
+#if AUX == AUX_TILT
+	PORTA = 0;		// no pullups on the adc inputs
+	PORTF = 0;
+#else
+	PORTA = 0xff;	// activate internal pullups
+	PORTF = 0xff;                          
+#endif
+	
+	for(i1=0;i1<32;i1++) id[i1]=0;
+	strcpy(id,"mk");	
+
+	// init led drivers
+	to_all_led(11, 7);                                    	// set scan limit to full range
+	to_all_led(10, 15);                               		// set to max intensity
+	for(i1 = 1; i1 < 9; i1++) to_all_led(i1, 0);         	// clear pattern 
+	
+	to_all_led(12, 1);                                    	// come out of shutdown mode 
+	to_all_led(15, 0);                                    	// test mode off
+
+	// startup sequence
+	to_led(8,12,0,0,0);
+	_delay_ms(64);
+	to_all_led(10, 13);
+	to_led(8,18,0,0,0); to_led(7,12,0,0,0);
+	_delay_ms(64);
+	to_all_led(10, 11);
+	to_led(8,33,0,0,0); to_led(7,18,0,0,0); to_led(6,12,0,0,0);
+	_delay_ms(64);
+#if !VARIBRIGHT
+	to_all_led(10, 9);
+	to_led(8,64,0,0,0); to_led(7,64,0,0,0); to_led(6,33,0,0,0); to_led(5,30,0,0,0);
+	_delay_ms(64);
+	to_all_led(10, 7);
+	to_led(8,0,0,1,0); to_led(7,0,0,1,0); to_led(6,0,0,1,0); to_led(5,128,0,0,0); to_led(4,64,0,0,0); to_led(3,33,0,0,0); to_led(2,30,0,0,0);
+	_delay_ms(64);
+	to_all_led(10, 5);
+	to_led(8,0,192,16,0); to_led(7,0,56,16,0); to_led(6,0,7,8,0); to_led(5,0,0,8,0); to_led(4,0,0,4,0); to_led(3,0,0,4,0); to_led(2,0,0,2,0); to_led(1,0,0,1,0);
+	_delay_ms(64);
+	to_all_led(10, 3);
+	to_led(8,0,0,128,32); to_led(7,0,0,128,16); to_led(6,0,0,128,16); to_led(5,0,0,128,8); to_led(4,0,0,64,6); to_led(3,0,128,64,1); to_led(2,0,112,64,0); to_led(1,0,15,32,0);
+	_delay_ms(64);
+	to_all_led(10, 1);
+	to_led(8,0,0,0,0); to_led(7,0,0,0,0); to_led(6,0,0,0,0); to_led(5,0,0,0,0); to_led(4,0,0,0,128); to_led(3,0,0,0,128); to_led(2,0,0,0,64); to_led(1,0,0,0,48);
+	_delay_ms(64);
+#endif
+	
+
+	// end startup sequence
+	for(i1 = 1; i1 < 9; i1++) to_all_led(i1, 0);			// clear pattern
+	to_all_led(10, 15);                            			// set to max intensity
+
+	// init data
+	for(i1=0;i1<10;i1++) rx[i1] = 0;
+			
+	for(i1=0;i1<4;i1++)
+		for(i2=0;i2<8;i2++)
+#if VARIBRIGHT
+			plane[0][i1][i2] = plane[1][i1][i2] = plane[2][i1][i2] = plane[3][i1][i2] = 0;
+#else
+			display[i1][i2] = 0;
+#endif
+
+	rx_count = rx_type = 0;
+	rx_length = 1;
+	rx_ring_write = rx_ring_read = 0;
+	usb_state = 0;
+	sleep_state = 1;
+	key_mode = 0;
+	display_dirty = 0;
+	keypad_row = 0;
+	output_write = 0;
+	output_read = 0;
+	output_dropped = 0;
+	output_high = 0;
+	stamp_write = stamp_read = 0;
+	key_clock = 0;
+	key_fast = key_rate = KEY_REFRESH_RATE;
+	key_idle = KEY_IDLE_RATE;
+	key_hold = key_left = KEY_HOLD;
+	rx_bytes = rx_packets = loops = loop_rate = 0;
+	rx_timeouts = rx_starved = 0;
+	display_refreshes = scans = scan_rate = rate_start = 0;
+	
+#if VARIBRIGHT
+	bam_mixed = 0;
+	bam_plane = 0;
+	bam_scale(15);
+	bam_due = 0;
+	bam_frames = bam_late = 0;
+#endif
+
+#if AUX == AUX_ENCODERS
+	for(i1=0;i1<8;i1++) {
+		enc_delta[i1] = 0;
+		enc_now[i1] = 0;
+		enc_prev[i1] = 0;
+	}
+	enc_next = 0;
+#endif
+
+#if AUX == AUX_TILT
+	aux_write = aux_read = 0;
+	aux_dropped = 0;
+#endif
+
+	buttonInit();
+		
+#if AUX == AUX_TILT
+	// init ADC
+	//ADMUX = (1<<ADLAR);	// set left align (for 8 bit mode)
+	ADMUX = (1<<MUX0);
+	ADCSRA = (1<<ADEN) | (1<<ADPS2);// | (1<<ADATE);	// turn on ADC, prescale
+	//DIDR0 = 0x03;	// disable digital inputs on ADC0-1
+	ADCSRA |= (1<<ADSC);		// start conversion
+	an[0][0] = an[0][1] = an[1][0] = an[1][1] = 127;
+	for(i1=0;i1<8;i1++) an_bucket[0][i1] = an_bucket[1][i1] = 127;
+	an_accum[0] = an_accum[1] = 1016; // 127 * 8
+	an_num = 0;
+	an_index = 0;
+#endif
+
+#if AUX != AUX_NONE
+	// read eeprom
+	while(EECR & (1<<EEWE));
+	EEAR = EEPROM_PORT_ENABLE;
+	EECR |= (1<<EERE);
+	port_enable = EEDR;
+	port_enable = 255;
+#endif
+	
+	// keypad timer init
+	TCCR0A |= KEY_CLOCK_SELECT; // timer0 on, prescale KEY_PRESCALE (p95)
+	TIMSK0 |= (1 << OCIE0A);// | (1<< TOIE0);  // enable timer0 interrupts
+	OCR0A = KEY_REFRESH_RATE;
+
+	// usb rx timer init
+	TCCR2A = (1<<WGM21) | (1<<CS21);	// ctc, clk/8
+	OCR2A = RX_POLL_RATE;
+	TIMSK2 |= (1 << OCIE2A);
+	
+#if VARIBRIGHT
+	// bam timer init
+	TCCR1A = 0;
+	TCCR1B = (1<<WGM12) | (1<<CS11);	// ctc, clk/8
+	OCR1A = BAM_SLOT - 1;
+	TIMSK1 |= (1 << OCIE1A);
+#elif AUX != AUX_NONE
+	// aux timer init
+	TCCR1A = 0;
+	TCCR1B |= AUX_CLOCK_SELECT; // prescale AUX_PRESCALE
+	TIMSK1 |= (1 << OCIE1A);
+	OCR1A = AUX_REFRESH_RATE;
+#endif
+	
+	// enable ints
+	sei();
+}
+
+// packet handlers, called once rx[] holds a whole packet
+// ===============================================================
+static void rx_sys_query(void)
+{
+	if(output_room(3)) {
+		output_put(_SYS_QUERY_RESPONSE);
+		output_put(1);
+		output_put(GRIDS);
+	}
+
+	if(output_room(3)) {
+		output_put(_SYS_QUERY_RESPONSE);
+		output_put(2);
+		output_put(GRIDS);
+	}
+
+#if AUX == AUX_ENCODERS
+	if(output_room(3)) {
+		output_put(_SYS_QUERY_RESPONSE);
+		output_put(5);
+		output_put(8);
+	}
+#endif
+}
+
+static void rx_sys_query_id(void)
+{
+	uint8_t i1;
+
+	if(output_room(33)) {
+		output_put(_SYS_ID);
+		for(i1=0;i1<32;i1++) output_put(id[i1]);
+	}
+}
+
+static void rx_sys_get_grid_size(void)
+{
+	if(output_room(3)) {
+		output_put(_SYS_REPORT_GRID_SIZE);
+		output_put(SIZE_X);
+		output_put(SIZE_Y);
+	}
+}
+
+static void rx_sys_get_schedule(void)
+{
+	uint8_t i1;
+
+	if(output_room(1 + PHASES*10)) {
+		output_put(_SYS_REPORT_SCHEDULE);
+		for(i1=0;i1<PHASES;i1++) {
+			output_put(phase_slice[i1]);
+			output_put(phase_deadline[i1]);
+			output_put16(phase_wait[i1]);
+			output_put16(phase_run[i1]);
+			output_put16(phase_misses[i1]);
+			output_put16(phase_overruns[i1]);
+			phase_wait[i1] = phase_run[i1] = 0;
+		}
+	}
+}
+
+// [type, fast, idle, hold lo, hi]: timer0 compares while keys are down
+// or debouncing and once they are idle, and the scans at fast after the
+// last busy one. equal compares scan at one rate. a compare of 0 would
+// fire every timer count and becomes 1, the hold covers at least a row
+// pass so a press still debouncing down is read again at fast
+static void rx_sys_set_scan(void)
+{
+	key_fast = rx[1] > KEY_RATE_MIN ? rx[1] : KEY_RATE_MIN;
+	key_idle = rx[2] > KEY_RATE_MIN ? rx[2] : KEY_RATE_MIN;
+	key_hold = rx[3] | rx[4] << 8;
+	if(key_hold < KEY_HOLD_MIN) key_hold = KEY_HOLD_MIN;
+	key_left = key_hold;
+}
+
+static void rx_sys_set_key_mode(void)
+{
+	key_mode = rx[1];
+}
+
+static void rx_sys_get_counters(void)
+{
+	uint16_t aux = 0;
+
+#if AUX == AUX_TILT
+	cli();
+	aux = aux_dropped;
+	sei();
+#endif
+	if(output_room(28)) {
+		output_put(_SYS_REPORT_COUNTERS);
+		output_put16(rx_bytes);
+		output_put16(rx_bytes >> 16);
+		output_put16(rx_packets);
+		output_put16(rx_packets >> 16);
+		output_put16(rx_resyncs);
+		output_put16(rx_timeouts);		// 0 without RX_TIMEOUT
+		output_put16(rx_starved);
+		output_put(output_high);
+		output_put16(output_dropped);
+		output_put16(display_refreshes);
+		output_put16(scan_rate);
+		output_put16(loop_rate);
+		output_put16(loop_rate >> 16);
+		output_put16(aux);
+	}
+}
+
+// swaps the s x s blocks of the 2s rows at a: the high s bits of the
+// first s rows with the low s bits of the next s
+static void swap_blocks(uint8_t *a, uint8_t s, uint8_t mask)
+{
+	uint8_t i1,t;
+
+	for(i1=0;i1<s;i1++) {
+		t = ((a[i1] >> s) ^ a[i1+s]) & mask;
+		a[i1+s] ^= t;
+		a[i1] ^= t << s;
+	}
+}
+
+// 8x8 bit matrix transpose in place: bit j of a[i] swaps with bit i of
+// a[j], by swapping bits, then 2x2 blocks, then 4x4 blocks. each step
+// only needs the rows it swaps, so a map runs them row n at a time as
+// its bytes arrive (see mk_loop): the bit swap once a pair is in, the
+// 2x2 once four are and the 4x4 with the last.
+static void transpose8_row(uint8_t *a, uint8_t n)
+{
+	if(n & 1) swap_blocks(a + n - 1, 1, 0x55);
+	if((n & 3) == 3) swap_blocks(a + n - 3, 2, 0x33);
+	if(n == 7) swap_blocks(a, 4, 0x0f);
+}
+
+// packets are row major and max7219 digits grid columns, so every map
+// goes through here (not static, bench.c times it)
+void transpose8(uint8_t *a)
+{
+	uint8_t i1;
+
+	for(i1=0;i1<8;i1++) transpose8_row(a, i1);
+}
+
+#if VARIBRIGHT
+// leds in mask on quadrant q, max7219 row r go to level 0-15
+static void led_level(uint8_t q, uint8_t r, uint8_t mask, uint8_t level)
+{
+	uint8_t b;
+
+	for(b=0;b<4;b++) {
+		if(level & (1 << b)) plane[b][q][r] |= mask;
+		else plane[b][q][r] &= ~mask;
+	}
+	display_dirty |= 1 << r;
+}
+
+// every led to level 0-15
+static void led_all(uint8_t level)
+{
+	uint8_t b,q,r;
+
+	for(b=0;b<4;b++)
+		for(q=0;q<4;q++)
+			for(r=0;r<8;r++)
+				plane[b][q][r] = (level & (1 << b)) ? 255 : 0;
+	display_dirty = 0xff;
+}
+
+static void rx_led_set0(void)
+{
+	// _LED_SET0 //////////////////////////////////////////////
+	led_level((rx[1] >> 3) + ((rx[2] >> 3)*2), 7-(rx[1] & 0x07), 1 << (rx[2] & 0x07), 0);
+}
+
+static void rx_led_set1(void)
+{
+	// _LED_SET1 //////////////////////////////////////////////
+	led_level((rx[1] >> 3) + ((rx[2] >> 3)*2), 7-(rx[1] & 0x07), 1 << (rx[2] & 0x07), 15);
+}
+
+static void rx_led_all0(void)
+{
+	// _LED_ALL0 //////////////////////////////////////////////
+	led_all(0);
+}
+
+static void rx_led_all1(void)
+{
+	// _LED_ALL1 //////////////////////////////////////////////
+	led_all(15);
+}
+
+static void rx_led_map(void)
+{
+	uint8_t i1,i2,b;
+
+	// _LED_MAP ///////////////////////////////////////////////
+	// the rows came in through transpose8_row, see mk_loop
+	i1 = (rx[1] >> 3) + (rx[2] >> 3)*2;
+
+	// on is level 15, every plane alike
+	for(i2=0;i2<8;i2++)
+		for(b=0;b<4;b++) plane[b][i1][i2] = rx[10-i2];
+	display_dirty = 0xff;
+}
+
+static void rx_led_col(void)
+{
+	uint8_t i1,b;
+
+	// _LED_COL ///////////////////////////////////////////////
+	// x offset is rx[1]
+	i1 = (rx[1] >> 3) + (rx[2] >> 3)*2;
+
+	for(b=0;b<4;b++) plane[b][i1][7-(rx[1] & 0x07)] = rx[3];
+	display_dirty |= 1 << (7-(rx[1] & 0x07));
+}
+
+static void rx_led_row(void)
+{
+	uint8_t i1,i2,i3,i4,b,bits;
+
+	// _LED_ROW ///////////////////////////////////////////////
+	// y offset is rx[2], bit y of every digit in every plane
+	i1 = (rx[1] >> 3) + (rx[2] >> 3)*2;
+	i2 = 1 << (rx[2] & 0x07);
+	bits = rev[rx[3]];
+
+	for(i3=0;i3<8;i3++) {
+		i4 = -(bits & 1) & i2;
+		for(b=0;b<4;b++) plane[b][i1][i3] = (plane[b][i1][i3] & ~i2) | i4;
+		bits >>= 1;
+	}
+	display_dirty = 0xff;
+}
+
+#else
+// grid cell x, y of quadrant i1 as display row (returned) and bit
+static uint8_t quad_cell(uint8_t i1, uint8_t x, uint8_t y, uint8_t *bit)
+{
+	uint8_t i2;
+
+	// swap x and y without a branch when the quadrant is turned
+	i2 = (x ^ y) & QUAD_SWAP(i1);
+	*bit = (x ^ i2) ^ QUAD_BIT(i1);
+	return (y ^ i2) ^ QUAD_ROW(i1);
+}
+
+// 8 cells along display row i2 of quadrant i1, bit i of bits the i'th
+// before QUAD_ROW and QUAD_BIT turn it
+static void quad_row_bits(uint8_t i1, uint8_t i2, uint8_t bits)
+{
+	i2 ^= QUAD_ROW(i1);
+	display[i1][i2] = QUAD_BIT(i1) ? rev[bits] : bits;
+	display_dirty |= 1 << i2;
+}
+
+// the same across the rows, at bit i2 of each
+static void quad_col_bits(uint8_t i1, uint8_t i2, uint8_t bits)
+{
+	uint8_t i3,i4;
+
+	if(QUAD_ROW(i1)) bits = rev[bits];
+	i4 = 1 << (i2 ^ QUAD_BIT(i1));
+
+	for(i3=0;i3<8;i3++) {
+		display[i1][i3] = (display[i1][i3] & ~i4) | (-(bits & 1) & i4);
+		bits >>= 1;
+	}
+	display_dirty = 0xff;
+}
+
+static void rx_led_set0(void)
+{
+	uint8_t i1,i2,i3;
+
+	// _LED_SET0 //////////////////////////////////////////////
+	i1 = (rx[1] >> 3) + ((rx[2] >> 3)*2); 
+	i2 = quad_cell(i1, rx[1] & 0x07, rx[2] & 0x07, &i3);
+	display[i1][i2] &= ~(1<<i3);
+	display_dirty |= 1 << i2;
+}
+
+static void rx_led_set1(void)
+{
+	uint8_t i1,i2,i3;
+
+	// _LED_SET1 //////////////////////////////////////////////
+	i1 = (rx[1] >> 3) + ((rx[2] >> 3)*2); 
+	i2 = quad_cell(i1, rx[1] & 0x07, rx[2] & 0x07, &i3);
+	display[i1][i2] |= (1<<i3);
+	display_dirty |= 1 << i2;
+}
+
+static void rx_led_all0(void)
+{
+	uint8_t i1,i2;
+
+	// _LED_ALL0 //////////////////////////////////////////////
+	for(i1=0;i1<4;i1++) {
+		for(i2=0;i2<8;i2++) {
+			display[i1][i2] = 0;
+		}
+	}
+	display_dirty = 0xff;
+}
+
+static void rx_led_all1(void)
+{
+	uint8_t i1,i2;
+
+	// _LED_ALL1 //////////////////////////////////////////////
+	for(i1=0;i1<4;i1++) {
+		for(i2=0;i2<8;i2++) {
+			display[i1][i2] = 255;
+		}
+	}
+	display_dirty = 0xff;
+}
+
+static void rx_led_map(void)
+{
+	uint8_t i1,i2,i3;
+
+	// _LED_MAP ///////////////////////////////////////////////
+	// the rows, turned as a whole: a turned quadrant's display rows are
+	// the packet's columns, transposed as they came in (see mk_loop)
+	i1 = (rx[1] >> 3) + (rx[2] >> 3)*2;
+
+	for(i2=0;i2<8;i2++) {
+		i3 = rx[3 + (i2 ^ QUAD_ROW(i1))];
+		display[i1][i2] = QUAD_BIT(i1) ? rev[i3] : i3;
+	}
+	display_dirty = 0xff;
+}
+
+static void rx_led_col(void)
+{
+	uint8_t i1;
+
+	// _LED_COL ///////////////////////////////////////////////
+	// x offset is rx[1]
+	i1 = (rx[1] >> 3) + (rx[2] >> 3)*2;
+
+	if(QUAD_SWAP(i1)) quad_row_bits(i1, rx[1] & 0x07, rx[3]);
+	else quad_col_bits(i1, rx[1] & 0x07, rx[3]);
+}
+
+static void rx_led_row(void)
+{
+	uint8_t i1;
+
+	// _LED_ROW ///////////////////////////////////////////////
+	// y offset is rx[2]
+	i1 = (rx[1] >> 3) + (rx[2] >> 3)*2;
+
+	if(QUAD_SWAP(i1)) quad_col_bits(i1, rx[2] & 0x07, rx[3]);
+	else quad_row_bits(i1, rx[2] & 0x07, rx[3]);
+}
+#endif
+
+static void rx_led_int(void)
+{
+	uint8_t i1;
+
+	// _LED_INT ///////////////////////////////////////////////
+	i1 = rx[1] & 0x0f;
+#if VARIBRIGHT
+	bam_scale(i1);			// from the next slot on
+#else
+	to_all_led(10,i1);
+#endif
+}
+
+#if VARIBRIGHT
+static void rx_led_mapx(void)
+{
+	uint8_t i1,i2,i3,i4;
+
+	// _LED_MAPX //////////////////////////////////////////////
+	i1 = (rx[1] >> 3) + (rx[2] >> 3)*2;
+
+	for(i2=0;i2<8;i2++) {
+		i4 = 1 << i2;
+		for(i3=0;i3<4;i3++) {
+			led_level(i1, 7-(i3*2), i4, rx[3+(i2*4)+i3] >> 4);
+			led_level(i1, 7-(i3*2+1), i4, rx[3+(i2*4)+i3] & 0xf);
+		}
+	}
+}
+
+static void rx_led_allx(void)
+{
+	// _LED_ALLX //////////////////////////////////////////////
+	led_all(rx[1]);
+}
+
+static void rx_led_setx(void)
+{
+	// _LED_SETX //////////////////////////////////////////////
+	led_level((rx[1] >> 3) + ((rx[2] >> 3)*2), 7-(rx[1] & 0x07), 1 << (rx[2] & 0x07), rx[3]);
+}
+
+static void rx_led_rowx(void)
+{
+	uint8_t i1,i2,i3;
+
+	// _LED_ROWX //////////////////////////////////////////////
+	// y offset is rx[2]
+	i1 = (rx[1] >> 3) + (rx[2] >> 3)*2;
+	i2 = 1 << (rx[2] & 0x07);
+
+	for(i3=0;i3<4;i3++) {
+		led_level(i1, 7-(i3*2), i2, rx[3+i3] >> 4);
+		led_level(i1, 7-(i3*2+1), i2, rx[3+i3] & 0xf);
+	}
+}
+
+static void rx_led_colx(void)
+{
+	uint8_t i1,i2;
+
+	// _LED_COLX //////////////////////////////////////////////
+	// x offset is rx[1]
+	i1 = (rx[1] >> 3) + (rx[2] >> 3)*2;
+
+	for(i2=0;i2<4;i2++) {
+		led_level(i1, 7-(rx[1] & 0x07), 1 << (i2*2), rx[3+i2] >> 4);
+		led_level(i1, 7-(rx[1] & 0x07), 1 << (i2*2+1), rx[3+i2] & 0xf);
+	}
+}
+#endif
+
+#if AUX == AUX_TILT
+static void rx_tilt_set_state_on(void)
+{
+	port_enable = 255;
+}
+
+static void rx_tilt_set_state_off(void)
+{
+	port_enable = 0;
+}
+#endif
+
+// handler for each packet type, 0 for types that are read and ignored
+static void (* const rx_handler[PACKET_TYPES])(void) PROGMEM = {
+	[_SYS_QUERY] = rx_sys_query,
+	[_SYS_QUERY_ID] = rx_sys_query_id,
+	[_SYS_GET_GRID_SIZE] = rx_sys_get_grid_size,
+	[_SYS_SET_SCAN] = rx_sys_set_scan,
+	[_SYS_SET_KEY_MODE] = rx_sys_set_key_mode,
+	[_SYS_GET_COUNTERS] = rx_sys_get_counters,
+	[_SYS_GET_SCHEDULE] = rx_sys_get_schedule,
+	[_LED_SET0] = rx_led_set0,
+	[_LED_SET1] = rx_led_set1,
+	[_LED_ALL0] = rx_led_all0,
+	[_LED_ALL1] = rx_led_all1,
+	[_LED_MAP] = rx_led_map,
+	[_LED_COL] = rx_led_col,
+	[_LED_ROW] = rx_led_row,
+	[_LED_INT] = rx_led_int,
+#if VARIBRIGHT
+	[_LED_MAPX] = rx_led_mapx,
+	[_LED_ALLX] = rx_led_allx,
+	[_LED_SETX] = rx_led_setx,
+	[_LED_ROWX] = rx_led_rowx,
+	[_LED_COLX] = rx_led_colx,
+#endif
+#if AUX == AUX_TILT
+	[_TILT_SET_STATE_ON] = rx_tilt_set_state_on,
+	[_TILT_SET_STATE_OFF] = rx_tilt_set_state_off,
+#endif
+};
+
+
+
+// main loop, one pass
+// ===============================================================
+// ===============================================================
+// ===============================================================
+void mk_loop(void)
+{
+	uint8_t i1,i2,i3,i4,i5,i6,i7;
+	void (*rx_call)(void);
+	uint8_t keys[4];
+	uint16_t key_sampled, key_sent;
+	uint16_t pass, t;
+	uint8_t busy;
+#if AUX == AUX_ENCODERS
+	char enc;
+#endif
+#if AUX == AUX_TILT
+	volatile uint8_t *p;
+#endif
+
+	loops++;
+
+	// ========================= ASLEEP:
+	if(SLEEP && sleep_state) {
+		if(!(PORT_IN(PINC) & C4_PWREN)) {
+			sleep_state = 0;				
+
+			to_all_led(12, 1);		// out of shutdown
+			for(i1=0;i1<64;i1++) {	// fade in
+				to_all_led(10, (i1)/4);
+				_delay_ms(8);
+			}
+		} 
+
+		_delay_ms(255);
+		
+		TIMSK0 |= (1 << OCIE0A);// | (1<< TOIE0);  // enable timer0 interrupts
+	}
+	
+	// ========================== NORMAL:
+	else {
+		pass = sched_now();
+
+		// ====================== scan keypads =========================================
+		if(scan_keypads) {
+			cli();
+			scan_keypads = 0;
+			key_sampled = key_clock;		// the tick that asked for this scan
+			t = key_due;
+			sei();
+			t = phase_begin(PHASE_KEYS, t);
+			busy = 0;
+
+			scans++;
+			if((uint16_t)(key_sampled - rate_start) >= RATE_WINDOW) {
+				scan_rate = scans;
+				loop_rate = loops;
+				scans = loops = 0;
+				rate_start = key_sampled;
+			}
+			
+			PORT_OUT(PORTD, 0);                      // setup PORTD for output
+			PORT_OUT(DDRD, 0xFF);
+
+			_delay_us(KEY_SETTLE_US);				// wait for voltage fall! due to high resistance pullup
+			PORT_SET(PORTE, E7_LD);	
+			_delay_us(KEY_SETTLE_US / 2);
+
+			keys[0] = keys[1] = keys[2] = keys[3] = 0;
+
+			// only the chains this build scans
+			for(i2=0;i2<8;i2++) {
+				i4 = ~PORT_IN(PINB);				// pressed keys pull low
+				keys[0] >>= 1; keys[1] >>= 1; keys[2] >>= 1; keys[3] >>= 1;
+				if(GRIDS > 0 && (i4 & B3_SER1)) keys[0] |= 0x80;
+				if(GRIDS > 1 && (i4 & B2_SER2)) keys[1] |= 0x80;
+				if(GRIDS > 2 && (i4 & B1_SER3)) keys[2] |= 0x80;
+				if(GRIDS > 3 && (i4 & B0_SER4)) keys[3] |= 0x80;
+
+				PORT_SET(PORTE, E6_CLK);
+				PORT_CLR(PORTE, E6_CLK);		
+			}
+
+			PORT_CLR(PORTE, E7_LD);	
+
+			// debounce a row of each chain at once, then report the changes
+			for(i5=0;i5<GRIDS;i5++) {
+				i3 = keypad_row + i5*8;
+				i1 = buttonScan(i3, keys[i5]);
+				busy |= keys[i5];
+
+				if(i1 && key_mode == 1) {
+					if(output_room(4)) {
+						// the register row is a grid column on turned quadrants
+						i2 = keypad_row ^ QUAD_ROW(i5);
+						if(QUAD_SWAP(i5)) {
+							output_put(_KEY_COL);
+							output_put(i2 + (i5 & 1)*8);
+							output_put((i5 >> 1)*8);
+						} else {
+							output_put(_KEY_ROW);
+							output_put((i5 & 1)*8);
+							output_put(i2 + (i5 >> 1)*8);
+						}
+						output_put(QUAD_BIT(i5) ? rev[button_state[i3]] : button_state[i3]);
+					}
+				}
+				else for(i2=0;i2<8;i2++) if(i1 & (1 << i2)) {
+					// x and y in the quadrant, swapped without a branch when turned
+					i6 = i2 ^ QUAD_BIT(i5);
+					i7 = keypad_row ^ QUAD_ROW(i5);
+					i4 = (i6 ^ i7) & QUAD_SWAP(i5);
+					i6 ^= i4;
+					i7 ^= i4;
+
+					i4 = (button_state[i3] >> i2) & 1;
+					key_event(i4, i6 + (i5 & 1)*8, i7 + (i5 >> 1)*8, key_sampled);
+				}
+			}
+			
+			keypad_row++;
+			keypad_row %= 8;
+			PORT_OUT(PORTB, keypad_row << 4);
+
+			// fast for key_hold scans after the keys were last busy, then
+			// key_idle. timer0 takes the compare at its next tick
+			if(busy | keys_down()) key_left = key_hold;
+			else if(key_left) key_left--;
+			i4 = key_left ? key_fast : key_idle;
+			if(i4 != key_rate) {
+				key_rate = i4;
+				phase_deadline[PHASE_KEYS] = KEY_TICK(i4) < 255 ? KEY_TICK(i4) : 255;
+			}
+
+			phase_end(PHASE_KEYS, t);
+		}
+
+		// ====================== check/read incoming serial	
+#if RX_TIMEOUT
+		if(rx_count && (uint16_t)(pass - rx_started) > RX_TIMEOUT) {
+			rx_resyncs++;
+			rx_timeouts++;
+			rx_count = 0;
+		}
+#endif
+
+		if(rx_ring_read != rx_ring_write) {
+			t = phase_begin(PHASE_RX, pass);
+
+			while(rx_ring_read != rx_ring_write && !scan_keypads) {
+				rx[rx_count] = rx_ring[rx_ring_read & (RX_RING_LENGTH-1)];
+				rx_ring_read++;
+				rx_bytes++;
+			
+				if(rx_count == 0) {		// get packet length if reading first byte
+					if(rx[0] >= PACKET_TYPES) {
+						rx_resyncs++;
+						continue;
+					}
+					rx_type = rx[0];
+					i1 = pgm_read_byte(&packet_length[rx_type]);
+					if(i1) {
+						rx_length = i1;
+						rx_count++;
+						rx_started = pass;
+					}
+					else {
+						rx_resyncs++;
+						continue;
+					}
+				}
+				else rx_count++;
+
+				// map rows go through the transpose as they arrive
+				if(rx_type == _LED_MAP && rx_count > 3 && QUAD_SWAP((rx[1] >> 3) + (rx[2] >> 3)*2))
+					transpose8_row(rx + 3, rx_count - 4);
+
+				if(rx_count == rx_length) {
+					rx_count = 0;
+					rx_length = 0;
+				
+					rx_packets++;
+					rx_call = (void (*)(void))pgm_read_ptr(&rx_handler[rx_type]);
+					if(rx_call) rx_call();
+
+					// the slice is checked between packets
+					if(phase_spent(PHASE_RX, t)) break;
+				}
+			}
+			if(rx_ring_read != rx_ring_write) rx_starved++;
+
+			phase_end(PHASE_RX, t);
+		}
+		
+#if !VARIBRIGHT
+		if(display_dirty) {
+			t = phase_begin(PHASE_REFRESH, pass);
+			for(i1=0;i1<8;i1++) {
+				if(display_dirty & (1 << i1)) {
+					to_led(i1+1,display[0][i1],display[1][i1],display[2][i1],display[3][i1]);
+					display_dirty &= ~(1 << i1);
+					if(display_dirty && phase_spent(PHASE_REFRESH, t)) break;
+				}
+			}
+			if(!display_dirty) display_refreshes++;
+			phase_end(PHASE_REFRESH, t);
+		}
+#endif
+
+		
+#if AUX == AUX_ENCODERS
+		// ====================== check encoder deltas
+		// round from where the last pass stopped
+		t = phase_begin(PHASE_AUX, pass);
+		
+		for(i2=0;i2<8;i2++) {
+			i1 = enc_next;
+			enc_next = (enc_next + 1) & 7;
+
+			cli();
+			enc = enc_delta[i1];
+			enc_delta[i1] &= 3;
+			sei();
+
+			enc >>= 2;
+			if(enc && (port_enable & (1 << i1))) {
+				if(output_room(3)) {
+					output_put(0x50);
+					output_put(i1);
+					output_put(enc);
+				}
+				if(phase_spent(PHASE_AUX, t)) break;
+			}
+		}
+		phase_end(PHASE_AUX, t);
+#endif
+
+#if AUX == AUX_TILT
+		// ====================== queue tilt packets
+		if(aux_read != aux_write) {
+			t = phase_begin(PHASE_AUX, pass);
+			while(aux_read != aux_write) {
+				p = aux_buffer + (aux_read & (AUX_BUFFER_LENGTH-1));
+				if(output_room(8))
+					for(i1=0;i1<8;i1++) output_put(p[i1]);
+				aux_read += 8;
+				if(phase_spent(PHASE_AUX, t)) break;
+			}
+			phase_end(PHASE_AUX, t);
+		}
+#endif
+		
+		// ====================== check/send output data
+		
+		PORT_OUT(PORTD, 0);                      // setup PORTD for output
+		PORT_OUT(DDRD, 0xFF);
+
+		if(output_read != output_write) {
+			t = phase_begin(PHASE_OUTPUT, pass);
+
+			while(output_read != output_write && !(PORT_IN(PINC) & C0_TXE)) {
+				// a stamped key event's sent time, taken as it goes out
+				if(stamp_read != stamp_write && output_read == stamp_at[stamp_read & (STAMP_RING_LENGTH-1)]) {
+					key_sent = sched_now();
+					output_buffer[output_read] = key_sent;
+					output_buffer[(uint8_t)(output_read + 1)] = key_sent >> 8;
+					stamp_read++;
+				}
+
+				PORT_SET(PORTC, C2_WR);
+				PORT_OUT(PORTD, output_buffer[output_read]);
+				PORT_CLR(PORTC, C2_WR);
+				output_read++;
+
+				// a packet cut here goes on next pass, the host reads a stream
+				if(!(output_read & 7) && phase_spent(PHASE_OUTPUT, t)) break;
+			}
+
+			phase_end(PHASE_OUTPUT, t);
+		}
+		
+#if VARIBRIGHT
+		// each bam slot sets the plane's intensity. rows lit at one level
+		// load once, rows with mixed levels once per slot with its plane
+		if(bam_due || display_dirty) {
+			t = phase_begin(PHASE_REFRESH, pass);
+			i2 = bam_plane;
+			if(bam_due) {
+				bam_due = 0;
+				display_dirty |= bam_mixed;
+				to_all_led(10, bam_intensity[i2]);
+			}
+			for(i1=0;i1<8;i1++) {
+				if(display_dirty & (1 << i1)) {
+					i3 = 0;
+					for(i4=0;i4<4;i4++)
+						i3 |= (plane[0][i4][i1] ^ plane[1][i4][i1]) | (plane[0][i4][i1] ^ plane[2][i4][i1]) | (plane[0][i4][i1] ^ plane[3][i4][i1]);
+					if(i3) bam_mixed |= 1 << i1;
+					else bam_mixed &= ~(1 << i1);
+
+					to_led(i1+1,plane[i2][0][i1],plane[i2][1][i1],plane[i2][2][i1],plane[i2][3][i1]);
+					display_dirty &= ~(1 << i1);
+					if(display_dirty && phase_spent(PHASE_REFRESH, t)) break;
+				}
+			}
+			if(!display_dirty) display_refreshes++;
+			phase_end(PHASE_REFRESH, t);
+		}
+#endif
+		
+		// ====================== check usb/sleep status
+		if(SLEEP && (PORT_IN(PINC) & C4_PWREN)) {
+			sleep_state = 1;
+			TIMSK0 = 0; // turn off keypad checking int
+
+			for(i1=0;i1<16;i1++) {	// fade out
+				to_all_led(10, 15-i1);
+				_delay_ms(64);
+			}
+			to_all_led(12, 0);		// shutdown
+		} 
+	}
+}
+
+#ifndef MK_HOST
+// main
+// ===============================================================
+// ===============================================================
+// ===============================================================
+int main(void)
+{
+	mk_init();
+
+	// main loop
+	while(1) mk_loop();
+
+	return 0;
+}
+#endif
@@ -0,0 +1,75 @@
+/************************************************************************
+port layer
+*************************************************************************
+every access to the pins wired to the led drivers (PORTE), keypad shift
+registers (PORTE/PORTB) and the FT245 (PORTC/PORTD) goes through the
+PORT_* macros below. on the atmega325 they are the plain register
+operations; with MK_HOST defined they call into the simulated hardware
+in firmware/host so the same mk.c can run on a pc.
+*/
+
+#ifndef __PORT_H__
+#define __PORT_H__
+
+#include <inttypes.h>
+
+// led pins
+#define E0_CLK 0x01
+#define E1_LD 0x02
+#define E2_SER4 0x04
+#define E3_SER3 0x08
+#define E4_SER2 0x10
+#define E5_SER1 0x20
+#define ALL_SER 0x3C
+
+// key in pins
+#define E6_CLK 0x40
+#define E7_LD 0x80
+#define B0_SER4 0x01
+#define B1_SER3 0x02
+#define B2_SER2 0x04
+#define B3_SER1 0x08
+
+// key sel pins
+#define B4_A0 0x10
+#define B5_A1 0x20
+#define B6_A2 0x40
+
+// usb pins
+#define C0_TXE 0x01
+#define C1_RXF 0x02
+#define C2_WR 0x04
+#define C3_RD 0x08
+#define C4_PWREN 0x10
+#define B7_USB 0x80
+
+
+#ifdef MK_HOST
+
+#include "sim.h"
+
+#define PORT_SET(reg, m)	sim_write(SIM_##reg, sim_read(SIM_##reg) | (m))
+#define PORT_CLR(reg, m)	sim_write(SIM_##reg, sim_read(SIM_##reg) & ~(m))
+#define PORT_OUT(reg, v)	sim_write(SIM_##reg, (v))
+#define PORT_IN(reg)		sim_read(SIM_##reg)
+
+// tables stay in ram on the pc
+#define PROGMEM
+#define pgm_read_byte(p)	(*(const uint8_t *)(p))
+#define pgm_read_ptr(p)		(*(void * const *)(p))
+
+#else
+
+#include <util/delay.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#define PORT_SET(reg, m)	((reg) |= (m))
+#define PORT_CLR(reg, m)	((reg) &= ~(m))
+#define PORT_OUT(reg, v)	((reg) = (v))
+#define PORT_IN(reg)		(reg)
+
+#endif
+
+#endif
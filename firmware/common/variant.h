@@ -0,0 +1,80 @@
+/************************************************************************
+variant parameters
+*************************************************************************
+mk.c and button.c are built once per firmware folder. each folder's
+config.h picks:
+
+  AUX          AUX_NONE, AUX_ENCODERS (8 on PORTA/PORTF, timer1) or
+               AUX_TILT (2 adc channels, timer1)
+  ROTATE_40H   1 for old 40h keypads, tiled with quadrants rotated
+  VARIBRIGHT   1 for 16 led levels by bit angle modulation on timer1,
+               the planes weighted by the max7219 intensity
+  SIZE_X, SIZE_Y, GRIDS
+               the grid, also given with -D for the sku hex files
+               (make skus), GRIDS is the number of 8x8 chains scanned
+  SLEEP        1 to fade out and stop scanning on usb suspend
+  RX_TIMEOUT   16us units a partial packet may wait for the rest of
+               its bytes, 0 forever
+  RX_SLICE     16us units a pass may spend on rx before the rest of
+               the loop gets the cpu, 0 no limit. rx always stops for
+               a due key scan, see the main loop scheduler in mk.c
+  KEY_IDLE_RATE, KEY_HOLD_MS
+               timer0 compare once no key has been down or debouncing
+               for KEY_HOLD_MS, KEY_REFRESH_RATE until then. the same
+               as KEY_REFRESH_RATE scans at one rate. _SYS_SET_SCAN in
+               mk.c changes both rates and the hold at run time
+
+and the timer rates below. code a build does not pick is left out by
+the preprocessor or folded away by the compiler.
+*/
+
+#ifndef __VARIANT_H__
+#define __VARIANT_H__
+
+#define AUX_NONE 0
+#define AUX_ENCODERS 1
+#define AUX_TILT 2
+
+#include "config.h"
+
+#if VARIBRIGHT && AUX != AUX_NONE
+#error "varibright and aux both need timer1"
+#endif
+
+#if VARIBRIGHT && ROTATE_40H
+#error "varibright has no 40h rotation"
+#endif
+
+#if GRIDS > 4 || SIZE_X > 16 || SIZE_Y > 16
+#error "at most 4 chains, 16x16"
+#endif
+
+// packet types with a table entry, the tilt ones start at 0x80
+#if AUX == AUX_TILT
+#define PACKET_TYPES 256
+#else
+#define PACKET_TYPES 32
+#endif
+
+// timer0 counts to 16us key_clock units
+#if KEY_PRESCALE == 1024
+#define KEY_CLOCK_SELECT ((1<<CS02) | (1<<CS00))
+#define KEY_STAMP_SHIFT 2
+#else
+#define KEY_CLOCK_SELECT (1<<CS02)
+#define KEY_STAMP_SHIFT 0
+#endif
+
+// KEY_HOLD_MS in scans at KEY_REFRESH_RATE
+#define KEY_HOLD ((uint32_t)KEY_HOLD_MS * 16000 / ((KEY_REFRESH_RATE + 1) * (uint32_t)KEY_PRESCALE))
+
+#if AUX_PRESCALE == 1024
+#define AUX_CLOCK_SELECT ((1<<CS12) | (1<<CS10))
+#else
+#define AUX_CLOCK_SELECT (1<<CS12)
+#endif
+
+// debounce rows, one per chain and keypad row
+#define BUTTON_ROWS (GRIDS ? GRIDS * 8 : 8)
+
+#endif
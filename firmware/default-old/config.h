@@ -0,0 +1,37 @@
+/************************************************************************
+version: default for old 40h keypads
+*************************************************************************
+no aux. see ../common/variant.h
+*/
+
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#define AUX AUX_NONE
+#define ROTATE_40H 1
+#define VARIBRIGHT 0
+
+#ifndef GRIDS
+#define SIZE_X 8
+#define SIZE_Y 8
+#define GRIDS 1
+#endif
+
+#define SLEEP 1
+#define RX_TIMEOUT 250		// 4ms, a few usb frames
+#define RX_SLICE 8
+
+// firmware version: default
+#define FW_VERSION 0
+
+// tuning
+#define KEY_REFRESH_RATE 15
+#define KEY_PRESCALE 1024
+#define KEY_SETTLE_US 2
+#define KEY_IDLE_RATE 15		// a row a ms already, no backing off
+#define KEY_HOLD_MS 250
+
+#define kButtonDownDefaultDebounceCount 1
+#define kButtonUpDefaultDebounceCount   8
+
+#endif
@@ -0,0 +1,37 @@
+/************************************************************************
+version: default
+*************************************************************************
+varibright, no aux. see ../common/variant.h
+*/
+
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#define AUX AUX_NONE
+#define ROTATE_40H 0
+#define VARIBRIGHT 1
+
+#ifndef GRIDS
+#define SIZE_X 8
+#define SIZE_Y 8
+#define GRIDS 1
+#endif
+
+#define SLEEP 0
+#define RX_TIMEOUT 0
+#define RX_SLICE 0
+
+// firmware version: default
+#define FW_VERSION 0
+
+// tuning
+#define KEY_REFRESH_RATE 2
+#define KEY_PRESCALE 256
+#define KEY_SETTLE_US 4			// keypad pullups are slow to fall
+#define KEY_IDLE_RATE 23		// 8x slower once the keys are idle
+#define KEY_HOLD_MS 250
+
+#define kButtonDownDefaultDebounceCount 0
+#define kButtonUpDefaultDebounceCount   24
+
+#endif
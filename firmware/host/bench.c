@@ -0,0 +1,552 @@
+/************************************************************************
+host benchmarks
+*************************************************************************
+runs one firmware variant against the simulated board as fast as the pc
+allows. host times measure the firmware logic, port writes are every
+PORT_* write the firmware made and stand in for avr i/o cycles.
+
+usage: bench <variant>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "port.h"
+#include "button.h"
+
+static const char *variant;
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static uint8_t grid_chains(void)
+{
+	uint8_t b[3];
+
+	sim_usb_feed((const uint8_t []) { 0x05 }, 1);
+	sim_drain();
+	sim_usb_take(b, 3);
+	return (b[1] / 8) * (b[2] / 8);
+}
+
+
+// parser throughput
+// ===============================================================
+// the stream is handed over one 64 byte usb packet per main loop pass,
+// the most a full speed bulk transfer puts in the ft245 fifo at once.
+#define USB_PACKET 64
+
+static uint8_t stream[1 << 22];
+
+// random packets of one type, x/y kept on the grid
+static uint32_t stream_random(uint8_t type, uint8_t len, uint32_t count)
+{
+	uint32_t i, j, n;
+
+	srand(1);
+	n = 0;
+	for(i=0;i<count;i++) {
+		stream[n] = type;
+		for(j=1;j<len;j++) stream[n+j] = rand();
+		stream[n+1] &= 0x0f;
+		stream[n+2] &= 0x0f;
+		n += len;
+	}
+	return n;
+}
+
+// single led chase: clear the last led, light the next one
+static uint32_t stream_chase(uint32_t count)
+{
+	uint32_t i, n;
+
+	n = 0;
+	for(i=0;i<count;i+=2) {
+		stream[n++] = 0x10;
+		stream[n++] = (i / 2) & 0x0f;
+		stream[n++] = ((i / 2) >> 4) & 0x0f;
+		stream[n++] = 0x11;
+		stream[n++] = (i / 2 + 1) & 0x0f;
+		stream[n++] = ((i / 2 + 1) >> 4) & 0x0f;
+	}
+	return n;
+}
+
+// led packets of mixed types, x/y kept on the grid
+static uint32_t stream_mixed(uint32_t bytes)
+{
+	static const uint8_t type[4] = { 0x11, 0x14, 0x15, 0x10 };
+	static const uint8_t len[4] = { 3, 11, 4, 3 };
+	uint32_t i, j, n;
+
+	srand(3);
+	for(i=0,n=0;n<bytes;i++) {
+		stream[n] = type[i % 4];
+		for(j=1;j<len[i % 4];j++) stream[n+j] = rand();
+		stream[n+1] &= 0x0f;
+		stream[n+2] &= 0x0f;
+		n += len[i % 4];
+	}
+	return n;
+}
+
+// chunk is the most bytes handed over per main loop pass
+static void bench_parse(const char *name, uint32_t n, uint32_t count, uint32_t chunk)
+{
+	uint32_t pos, loops;
+	double t;
+
+	sim_boot();
+	t = now();
+	loops = 0;
+
+	for(pos=0;pos<n || sim_usb_pending();loops++) {
+		if(pos < n && !sim_usb_pending())
+			pos += sim_usb_feed(stream + pos, n - pos < chunk ? n - pos : chunk);
+		sim_loop();
+	}
+	sim_drain();
+
+	t = now() - t;
+
+	printf("%-14s parse %-5s %9.0f packets/s  %6.1f port writes/packet  %5.2f led loads/packet  %5.2f packets/loop\n",
+		variant, name, count / t, (double)sim.port_writes / count,
+		(double)sim.led_loads / count, (double)count / loops);
+}
+
+// every packet type on its own: sim cycles are the i/o and main loop
+// passes a packet costs, host ns the handler logic. types with no
+// handler are read and dropped, which is the dispatch cost alone.
+extern const uint8_t packet_length[];
+
+static void bench_opcodes(void)
+{
+	uint32_t t, n, pos, count;
+	uint64_t cycles;
+	double h;
+
+	count = 100000;
+
+	for(t=0;t<32;t++) {
+		if(!packet_length[t]) continue;
+		n = stream_random(t, packet_length[t], count);
+
+		sim_boot();
+		cycles = sim.cycles;
+		h = now();
+
+		for(pos=0;pos<n || sim_usb_pending();) {
+			if(pos < n && !sim_usb_pending())
+				pos += sim_usb_feed(stream + pos, n - pos < USB_PACKET ? n - pos : USB_PACKET);
+			sim_loop();
+			sim_usb_take(NULL, SIM_USB_BUFFER);
+		}
+		sim_drain();
+
+		h = now() - h;
+
+		printf("%-14s opcode 0x%02x  %2u bytes  %7.1f sim cycles/packet  %6.1f host ns/packet\n",
+			variant, t, packet_length[t], (double)(sim.cycles - cycles) / count, h * 1e9 / count);
+	}
+}
+
+
+// usb receive under load
+// ===============================================================
+// a mixed led stream sent as fast as full speed usb fills the ft245
+// (about a byte per us) while the keypad scans. latency is the time a
+// byte waits in the ft245 fifo, stalls are the time the host could not
+// send because the fifo was full. sched is what the main loop scheduler
+// saw meanwhile: how late key scans started and how long rx ran.
+extern uint16_t phase_wait[], phase_run[], phase_misses[], rx_starved;
+
+static void bench_rx(void)
+{
+	uint32_t n, period, ticks;
+	uint64_t next, start;
+
+	n = stream_mixed(200000);
+
+	sim_boot();
+	period = sim_timer0_period_us() * 16;
+	start = sim.cycles;
+	next = start + period;
+	ticks = 0;
+	sim_usb_stream(stream, n, 16);
+
+	while(sim.stream_pos < n || sim_usb_pending()) {
+		if(sim.cycles >= next) {
+			TIMER0_COMP_vect();
+			next += period;
+			ticks++;
+		}
+		sim_loop();
+	}
+
+	printf("%-14s rx     %7.0f bytes/s  fifo wait %.1f/%.1f us  host stalled %.1f%%\n",
+		variant, n / ((sim.cycles - start) / 16e6),
+		(double)sim.rx_latency_sum / sim.rx_fetches / 16, sim.rx_latency_max / 16.0,
+		100.0 * sim.stream_stalled / (sim.cycles - start));
+	printf("%-14s sched  key scan late %u us at most  %u of %u ticks missed  rx ran %u us at most  %u passes cut short\n",
+		variant, phase_wait[0] * 16, phase_misses[0], ticks, phase_run[1] * 16, rx_starved);
+}
+
+
+// varibright refresh
+// ===============================================================
+// a full 16 level gradient on every quadrant, either left alone or
+// restirred by 10000 _LED_SETX a second while the keypad scans. cpu share counts every row shifted to the drivers at the hand
+// counted cost of to_led on the avr, the sim does not clock pure logic.
+#define AVR_TO_LED_CYCLES 330
+
+extern volatile uint16_t bam_frames __attribute__((weak));
+extern volatile uint16_t bam_late __attribute__((weak));
+
+static void bench_bam(const char *name, uint8_t stirred)
+{
+	uint8_t q, i;
+	uint32_t n, period, frames, late;
+	uint64_t next, start, loads;
+
+	if(!&bam_frames) return;
+
+	sim_boot();
+	for(q=0;q<4;q++) {
+		stream[0] = 0x1a; stream[1] = (q & 1) * 8; stream[2] = (q >> 1) * 8;
+		for(i=0;i<32;i++) stream[3+i] = ((2*i + q) & 15) << 4 | ((2*i + 1 + q) & 15);
+		sim_usb_feed(stream, 35);
+		sim_drain();
+	}
+
+	n = stirred ? stream_random(0x18, 4, 20000) : 0;
+
+	period = sim_timer0_period_us() * 16;
+	start = sim.cycles;
+	next = start + period;
+	loads = sim.led_loads;
+	frames = bam_frames;
+	late = bam_late;
+	if(stirred) sim_usb_stream(stream, n, 400);
+
+	while(sim.cycles - start < 16000000) {
+		if(sim.cycles >= next) {
+			TIMER0_COMP_vect();
+			next += period;
+		}
+		sim_loop();
+	}
+
+	printf("%-14s bam    %-7s %5.1f Hz  %u late planes  %6.0f rows/s  cpu ~%4.1f%%  rx %6.0f bytes/s\n",
+		variant, name, (double)(uint16_t)(bam_frames - frames) * 16e6 / (sim.cycles - start),
+		(uint16_t)(bam_late - late), (double)(sim.led_loads - loads) * 16e6 / (sim.cycles - start),
+		100.0 * (sim.led_loads - loads) * AVR_TO_LED_CYCLES / (sim.cycles - start),
+		stirred ? sim.stream_pos * 16e6 / (sim.cycles - start) : 0);
+}
+
+
+// led driver shift, one row to all four drivers
+// ===============================================================
+void to_led(char data_all, char data1, char data2, char data3, char data4);
+
+static void bench_to_led(void)
+{
+	uint32_t i, rows;
+	double t;
+
+	sim_boot();
+	rows = 4000000;
+	t = now();
+
+	for(i=0;i<rows;i++)
+		to_led((i & 7) + 1, i, i >> 8, i >> 16, i >> 3);
+
+	t = now() - t;
+
+	printf("%-14s to_led %9.0f rows/s  %6.1f port writes/row\n",
+		variant, rows / t, (double)sim.port_writes / rows);
+}
+
+
+// map transpose
+// ===============================================================
+// transpose8 against the loop _LED_MAP ran before it, a bit at a time
+// with a branch on each, over the same random quadrants
+void transpose8(uint8_t *a);
+
+static void transpose_loop(uint8_t *a)
+{
+	uint8_t i2, i3, i4, d[8];
+
+	memset(d, 0, 8);
+	for(i2=0;i2<8;i2++) {
+		i4 = 1 << i2;
+		for(i3=0;i3<8;i3++) {
+			if(a[i2] & (1 << i3)) d[i3] |= i4;
+			else d[i3] &= ~i4;
+		}
+	}
+	memcpy(a, d, 8);
+}
+
+static void bench_transpose(void)
+{
+	uint32_t i, j, n, differ;
+	uint8_t a[8], b[8];
+	double t, tk, tl;
+
+	n = sizeof(stream) / 8;
+	srand(4);
+	for(i=0;i<n*8;i++) stream[i] = rand();
+
+	t = now();
+	for(i=0;i<n;i++) transpose8(stream + i*8);
+	tk = now() - t;
+
+	t = now();
+	for(i=0;i<n;i++) transpose_loop(stream + i*8);
+	tl = now() - t;
+
+	// and both must give the same quadrant
+	for(i=0,differ=0;i<n;i++) {
+		for(j=0;j<8;j++) a[j] = b[j] = stream[i*8 + j] ^ i;
+		transpose8(a);
+		transpose_loop(b);
+		differ += memcmp(a, b, 8) != 0;
+	}
+
+	printf("%-14s transpose  kernel %5.1f ns  bit loop %5.1f ns per 8x8  %u differ\n",
+		variant, tk * 1e9 / n, tl * 1e9 / n, differ);
+}
+
+
+// key scan latency
+// ===============================================================
+static void bench_keys(void)
+{
+	uint8_t chains, c, r, k;
+	uint32_t i, n, press_max, press_sum, release_max, release_sum, trials;
+	uint32_t period, limit;
+	double t;
+
+	sim_boot();
+	chains = grid_chains();
+	period = sim_timer0_period_us();
+	srand(2);
+	trials = 2000;
+	limit = 8 * (kButtonUpDefaultDebounceCount + 2);
+	press_max = press_sum = release_max = release_sum = 0;
+	t = now();
+
+	for(i=0;i<trials;i++) {
+		c = rand() % chains;
+		r = rand() % 8;
+		k = rand() % 8;
+
+		// random phase against the row scan
+		for(n=rand()%8;n;n--) sim_tick();
+
+		sim_key(c, r, k, 1);
+		for(n=1;sim.tx_count == sim.tx_read && n < limit;n++) sim_tick();
+		sim_usb_take(NULL, SIM_USB_BUFFER);
+		press_sum += n;
+		if(n > press_max) press_max = n;
+
+		sim_key(c, r, k, 0);
+		for(n=1;sim.tx_count == sim.tx_read && n < limit;n++) sim_tick();
+		sim_usb_take(NULL, SIM_USB_BUFFER);
+		release_sum += n;
+		if(n > release_max) release_max = n;
+	}
+
+	t = now() - t;
+
+	printf("%-14s keys   scan tick %u us  press %.1f/%u ticks (%.2f/%.2f ms)  release %.1f/%u ticks (%.2f/%.2f ms)  %.0f ticks/s host\n",
+		variant, period,
+		(double)press_sum / trials, press_max,
+		(double)press_sum / trials * period / 1000, press_max * period / 1000.0,
+		(double)release_sum / trials, release_max,
+		(double)release_sum / trials * period / 1000, release_max * period / 1000.0,
+		(press_sum + release_sum) / t);
+}
+
+
+// scan rate policy
+// ===============================================================
+// a press after a second with no key down (idle) and one straight after
+// the last release (busy), and the share of a second the scans took with
+// no key down and with one held, port i/o and delays as the sim counts
+// them. timer0 fires on the sim clock, the time between ticks is skipped.
+// fixed pins the compare at KEY_REFRESH_RATE, adaptive is the build's
+// KEY_IDLE_RATE after KEY_HOLD_MS.
+#define SECOND 16000000ULL
+
+static uint64_t tick_at, scan_cycles;
+
+// the board up to sim time until, or until it has sent something
+static void scan_run(uint64_t until)
+{
+	uint64_t c;
+
+	while(sim.cycles < until) {
+		if(sim.cycles >= tick_at) {
+			TIMER0_COMP_vect();
+			tick_at += sim_timer0_period_us() * 16;
+			c = sim.cycles;
+			sim_loop();
+			scan_cycles += sim.cycles - c - SIM_LOOP_CYCLES;
+			if(sim.tx_count != sim.tx_read) return;
+		}
+		else sim_delay_us(((tick_at < until ? tick_at : until) - sim.cycles + 15) / 16);
+	}
+}
+
+// the same, with whatever it sends thrown away
+static void scan_for(uint64_t cycles)
+{
+	uint64_t until = sim.cycles + cycles;
+
+	while(sim.cycles < until) {
+		scan_run(until);
+		sim_usb_take(NULL, SIM_USB_BUFFER);
+	}
+}
+
+// press latency in us, the event's pass included
+static uint32_t scan_press(uint8_t c, uint8_t r, uint8_t k)
+{
+	uint64_t p;
+
+	sim_key(c, r, k, 1);
+	p = sim.cycles;
+	scan_run(p + SECOND);
+	p = (sim.cycles - p) / 16;
+	sim_usb_take(NULL, SIM_USB_BUFFER);
+	sim_key(c, r, k, 0);
+	scan_run(sim.cycles + SECOND);
+	sim_usb_take(NULL, SIM_USB_BUFFER);
+	return p;
+}
+
+static void bench_scan(const char *name, uint8_t idle)
+{
+	const uint8_t set[5] = { 0x0d, KEY_REFRESH_RATE, idle, KEY_HOLD & 0xff, KEY_HOLD >> 8 };
+	uint8_t chains, c, r, k;
+	uint32_t i, trials, n, max[2];
+	uint64_t sum[2];
+	double cpu[2];
+
+	sim_boot();
+	chains = grid_chains();
+	sim_usb_feed(set, sizeof(set));
+	sim_drain();
+	tick_at = sim.cycles;
+	srand(3);
+	trials = 64;
+	sum[0] = sum[1] = max[0] = max[1] = 0;
+
+	for(i=0;i<trials;i++) {
+		c = rand() % chains;
+		r = rand() % 8;
+		k = rand() % 8;
+
+		// a second idle and a random part of a row pass, then straight
+		// after that release another press
+		scan_for(SECOND + rand() % (8 * (idle + 1) * KEY_PRESCALE));
+		n = scan_press(c, r, k);
+		sum[0] += n;
+		if(n > max[0]) max[0] = n;
+
+		scan_for(rand() % (8 * (KEY_REFRESH_RATE + 1) * KEY_PRESCALE));
+		n = scan_press(c, (r + 3) % 8, k);
+		sum[1] += n;
+		if(n > max[1]) max[1] = n;
+	}
+
+	scan_for(SECOND);
+	scan_cycles = 0;
+	scan_for(SECOND);
+	cpu[0] = 100.0 * scan_cycles / SECOND;
+
+	sim_key(0, 0, 0, 1);
+	scan_for(SECOND / 10);
+	scan_cycles = 0;
+	scan_for(SECOND);
+	cpu[1] = 100.0 * scan_cycles / SECOND;
+	sim_key(0, 0, 0, 0);
+
+	printf("%-14s scan   %-8s press idle %.2f/%.2f ms  busy %.2f/%.2f ms  scan cpu idle %.1f%%  busy %.1f%%\n",
+		variant, name, sum[0] / 1000.0 / trials, max[0] / 1000.0, sum[1] / 1000.0 / trials, max[1] / 1000.0,
+		cpu[0], cpu[1]);
+}
+
+
+// output queue under a full-grid press
+// ===============================================================
+extern uint16_t output_dropped;
+extern uint8_t output_high;
+
+// reading: the host empties the ft245 after every scan, otherwise it
+// stalls and the ft245 fills up. rows: whole key rows per packet
+static void bench_output(const char *name, uint8_t reading, uint8_t rows)
+{
+	uint8_t chains, c, r, k;
+	uint32_t n, before, most, expected, sent;
+
+	sim_boot();
+	chains = grid_chains();
+	expected = rows ? chains * 8 * 4 : chains * 64 * 3;
+	if(rows) {
+		sim_usb_feed((const uint8_t []) { 0x0e, 1 }, 2);
+		sim_drain();
+	}
+	sent = sim.tx_count;
+	most = 0;
+
+	for(c=0;c<chains;c++)
+		for(r=0;r<8;r++)
+			for(k=0;k<8;k++) sim_key(c, r, k, 1);
+
+	for(n=0;n<16;n++) {
+		before = sim.tx_count;
+		sim_tick();
+		if(sim.tx_count - before > most) most = sim.tx_count - before;
+		if(reading) sim_usb_take(NULL, SIM_USB_BUFFER);
+	}
+
+	printf("%-14s output %-7s %u/%u bytes sent  %u max per scan  queue high %u  %u packets dropped  %u written on TXE\n",
+		variant, name, sim.tx_count - sent, expected, most, output_high, output_dropped, sim.tx_dropped);
+}
+
+
+// ===============================================================
+int main(int argc, char **argv)
+{
+	variant = argc > 1 ? argv[1] : "mk";
+
+	bench_parse("set", stream_random(0x11, 3, 1000000), 1000000, USB_PACKET);
+	bench_parse("map", stream_random(0x14, 11, 300000), 300000, USB_PACKET);
+	bench_parse("row", stream_random(0x15, 4, 800000), 800000, USB_PACKET);
+
+	// one led change per pass, as an app animating a single led sends them
+	bench_parse("chase", stream_chase(1000000), 1000000, 3);
+	bench_opcodes();
+	bench_rx();
+	bench_to_led();
+	bench_transpose();
+	bench_bam("still", 0);
+	bench_bam("stirred", 1);
+	bench_keys();
+	bench_scan("fixed", KEY_REFRESH_RATE);
+	if(KEY_IDLE_RATE != KEY_REFRESH_RATE) bench_scan("adaptive", KEY_IDLE_RATE);
+	bench_output("reading", 1, 0);
+	bench_output("stalled", 0, 0);
+	bench_output("rows", 0, 1);
+
+	return 0;
+}
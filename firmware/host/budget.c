@@ -0,0 +1,837 @@
+/************************************************************************
+worst case cycle and stack budget
+*************************************************************************
+reads a linked avr firmware (mk.elf), decodes its code and walks every
+path through each function for the most cpu cycles it can take. calls
+add the callee's worst case, loops their worst pass times a bound.
+
+usage: budget [-t prefix] mk.elf mk.budget [file.su ...]
+
+mk.budget holds one line per fact, as make budget extracts them from
+mk.c with the preprocessor:
+
+  budget "NAME" symbol cycles	interrupt handler and its timer period
+  loops "NAME" symbol passes, ...	most passes of symbol's loops, one
+				bound per nesting level, outermost first
+
+the .su files from -fstack-usage give each function's frame, the report
+adds the return addresses down the deepest call chain.
+
+an icall may reach any function whose name starts with prefix (the rx
+packet handlers). a function with a loop but no bound counts each loop
+once and is marked with ?, it never fails the budget. the loops gcc
+makes for a shift by a variable count are a level like any other, but
+past the levels given they bound themselves at 8 passes per shift
+instruction. interrupts cost 7 extra cycles for the response and the
+vector jmp.
+
+exits non zero when an interrupt's worst case is longer than its period,
+a budget names a symbol the elf does not have, or a function nests a
+loop deeper than its bounds go.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <elf.h>
+
+#define MAX_FUNCS 512
+#define MAX_BUDGET 64
+#define ISR_ENTRY_CYCLES 7
+#define MAX_NEST 8
+
+static uint8_t *image;
+static uint32_t text_addr, text_size;
+static const uint8_t *text;
+
+struct func {
+	char name[64];
+	uint32_t addr, size;		// bytes
+	int stack;					// frame from .su, -1 unknown
+	uint32_t loops[MAX_NEST];	// bound per nesting level, outermost first
+	int nest;					// levels given, 0 none
+	const char *label;			// name in mk.c for interrupts
+	uint32_t period;			// 0 if not an interrupt
+};
+
+static struct func funcs[MAX_FUNCS];
+static int nfuncs;
+static const char *icall_prefix;
+static int errors;				// facts that do not fit the elf
+
+
+// elf
+// ===============================================================
+static void load_elf(const char *path)
+{
+	FILE *f;
+	long len;
+	Elf32_Ehdr *eh;
+	Elf32_Shdr *sh, *sym, *str;
+	Elf32_Sym *s;
+	const char *names;
+	uint32_t i, n;
+	int j;
+
+	if(!(f = fopen(path, "rb"))) { perror(path); exit(2); }
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	image = malloc(len);
+	if(fread(image, 1, len, f) != (size_t)len) { perror(path); exit(2); }
+	fclose(f);
+
+	eh = (Elf32_Ehdr *)image;
+	if(memcmp(eh->e_ident, ELFMAG, SELFMAG) || eh->e_machine != EM_AVR) {
+		fprintf(stderr, "%s: not an avr elf\n", path);
+		exit(2);
+	}
+
+	sh = (Elf32_Shdr *)(image + eh->e_shoff);
+	names = (const char *)image + sh[eh->e_shstrndx].sh_offset;
+	sym = str = NULL;
+
+	for(i=0;i<eh->e_shnum;i++) {
+		if(!strcmp(names + sh[i].sh_name, ".text")) {
+			text = image + sh[i].sh_offset;
+			text_addr = sh[i].sh_addr;
+			text_size = sh[i].sh_size;
+		}
+		if(sh[i].sh_type == SHT_SYMTAB) {
+			sym = &sh[i];
+			str = &sh[sh[i].sh_link];
+		}
+	}
+	if(!text || !sym) {
+		fprintf(stderr, "%s: no .text or symbols\n", path);
+		exit(2);
+	}
+
+	// functions, and the labels hand written library code uses instead
+	s = (Elf32_Sym *)(image + sym->sh_offset);
+	n = sym->sh_size / sizeof(Elf32_Sym);
+	for(i=0;i<n && nfuncs<MAX_FUNCS;i++) {
+		names = (const char *)image + str->sh_offset + s[i].st_name;
+		if(s[i].st_shndx == SHN_UNDEF || s[i].st_shndx >= SHN_LORESERVE) continue;
+		if(strcmp((const char *)image + sh[eh->e_shstrndx].sh_offset + sh[s[i].st_shndx].sh_name, ".text")) continue;
+		if(ELF32_ST_TYPE(s[i].st_info) != STT_FUNC &&
+			!(ELF32_ST_TYPE(s[i].st_info) == STT_NOTYPE && ELF32_ST_BIND(s[i].st_info) != STB_LOCAL)) continue;
+		if(!*names || *names == '.') continue;
+
+		for(j=0;j<nfuncs && funcs[j].addr != s[i].st_value;j++);
+		if(j < nfuncs) {
+			// aliases: keep the sized one, or the first
+			if(!funcs[j].size && s[i].st_size) {
+				snprintf(funcs[j].name, sizeof(funcs[j].name), "%s", names);
+				funcs[j].size = s[i].st_size;
+			}
+			continue;
+		}
+		snprintf(funcs[nfuncs].name, sizeof(funcs[nfuncs].name), "%s", names);
+		funcs[nfuncs].addr = s[i].st_value;
+		funcs[nfuncs].size = s[i].st_size;
+		funcs[nfuncs].stack = -1;
+		nfuncs++;
+	}
+
+	// labels without a size run up to the next one
+	for(j=0;j<nfuncs;j++) {
+		if(funcs[j].size) continue;
+		funcs[j].size = text_addr + text_size - funcs[j].addr;
+		for(i=0;i<(uint32_t)nfuncs;i++)
+			if(funcs[i].addr > funcs[j].addr && funcs[i].addr - funcs[j].addr < funcs[j].size)
+				funcs[j].size = funcs[i].addr - funcs[j].addr;
+	}
+}
+
+static struct func *func_at(uint32_t addr)
+{
+	int i;
+	struct func *best = NULL;
+
+	for(i=0;i<nfuncs;i++)
+		if(addr >= funcs[i].addr && addr < funcs[i].addr + funcs[i].size)
+			if(!best || funcs[i].addr > best->addr) best = &funcs[i];
+	return best;
+}
+
+static struct func *func_named(const char *name)
+{
+	int i;
+
+	for(i=0;i<nfuncs;i++)
+		if(!strcmp(funcs[i].name, name)) return &funcs[i];
+	return NULL;
+}
+
+
+// instructions, avr enhanced core (atmega325) timing
+// ===============================================================
+enum { I_PLAIN, I_BRANCH, I_SKIP, I_JUMP, I_CALL, I_IJMP, I_ICALL, I_RET };
+
+struct insn {
+	uint32_t addr;
+	uint8_t words, cycles, kind;
+	uint32_t target;			// byte address for branches, jumps and calls
+};
+
+static uint16_t word_at(uint32_t addr)
+{
+	if(addr < text_addr || addr + 2 > text_addr + text_size) return 0;
+	return text[addr - text_addr] | text[addr - text_addr + 1] << 8;
+}
+
+static int two_words(uint16_t w)
+{
+	return (w & 0xfe0c) == 0x940c		// jmp, call
+		|| (w & 0xfc0f) == 0x9000;		// lds, sts
+}
+
+static void decode(uint32_t addr, struct insn *in)
+{
+	uint16_t w = word_at(addr);
+	int16_t k;
+
+	in->addr = addr;
+	in->words = two_words(w) ? 2 : 1;
+	in->cycles = 1;
+	in->kind = I_PLAIN;
+	in->target = 0;
+
+	if((w & 0xfe0e) == 0x940c) {				// jmp
+		in->kind = I_JUMP; in->cycles = 3;
+		in->target = (((uint32_t)(w & 0x01f0) << 13) | ((w & 1) << 16) | word_at(addr + 2)) * 2;
+	}
+	else if((w & 0xfe0e) == 0x940e) {			// call
+		in->kind = I_CALL; in->cycles = 4;
+		in->target = (((uint32_t)(w & 0x01f0) << 13) | ((w & 1) << 16) | word_at(addr + 2)) * 2;
+	}
+	else if((w & 0xe000) == 0xc000) {			// rjmp, rcall
+		k = w & 0x0fff;
+		if(k & 0x0800) k -= 0x1000;
+		in->kind = (w & 0x1000) ? I_CALL : I_JUMP;
+		in->cycles = (w & 0x1000) ? 3 : 2;
+		in->target = addr + 2 + k * 2;
+	}
+	else if((w & 0xf800) == 0xf000) {	// brbs, brbc
+		k = (w >> 3) & 0x7f;
+		if(k & 0x40) k -= 0x80;
+		in->kind = I_BRANCH;
+		in->target = addr + 2 + k * 2;
+	}
+	else if((w & 0xfc08) == 0xfc00 || (w & 0xfd00) == 0x9900 || (w & 0xfc00) == 0x1000)
+		in->kind = I_SKIP;						// sbrc sbrs, sbic sbis, cpse
+	else if(w == 0x9508 || w == 0x9518) {		// ret, reti
+		in->kind = I_RET; in->cycles = 4;
+	}
+	else if(w == 0x9409 || w == 0x9419) {		// ijmp, eijmp
+		in->kind = I_IJMP; in->cycles = 2;
+	}
+	else if(w == 0x9509 || w == 0x9519) {		// icall, eicall
+		in->kind = I_ICALL; in->cycles = 3;
+	}
+	else if(w == 0x95c8 || w == 0x95d8 || (w & 0xfe0c) == 0x9004)
+		in->cycles = 3;							// lpm, elpm
+	else if(w == 0x95e8)
+		in->cycles = 4;							// spm, the busy wait is not counted
+	else if((w & 0xfc00) == 0x9000)
+		in->cycles = 2;							// lds sts, ld st with pointer update, push pop
+	else if((w & 0xd000) == 0x8000)
+		in->cycles = 2;							// ld st, ldd std
+	else if((w & 0xfe00) == 0x9600 || (w & 0xfc00) == 0x9c00 || (w & 0xfe00) == 0x0200)
+		in->cycles = 2;							// adiw sbiw, mul, muls mulsu fmul
+	else if((w & 0xfd00) == 0x9800)
+		in->cycles = 2;							// cbi sbi
+}
+
+
+// worst case paths
+// ===============================================================
+// a function is cut into instructions, loops are address ranges closed
+// by a jump back to their first instruction. innermost loops collapse
+// first into one node costing bound * worst pass + worst way out, then
+// the longest path runs forward through the function in address order.
+// a first run on a copy of the graph only finds the loops, so each one's
+// nesting level, and with it its bound, is known before the costs.
+
+#define EXIT_RET -1				// left through ret, a tail call or ijmp
+#define EXIT_IJMP -2			// left through ijmp with no known way back
+
+struct edge { int to; uint64_t cost; };
+
+struct node {
+	struct edge *e;
+	int ne, cap;
+};
+
+struct loop {
+	int lo, hi;					// instruction range
+	int parent;					// loop it collapses into, -1 none
+	int shifts;					// shift instructions of a shift loop, else 0
+	uint64_t bound;				// 0 none
+};
+
+struct result {
+	uint64_t cycles;			// worst case from the entry
+	int unbounded;				// loops without a bound on some path
+	int via_ijmp;				// ended through ijmp (__prologue_saves__)
+	int returns;				// some path gets out, main does not
+	int done, busy;
+};
+
+static struct result *memo;		// per byte address of text
+static struct result analyse(uint32_t entry);
+
+static void add_edge(struct node *n, int to, uint64_t cost)
+{
+	int i;
+
+	for(i=0;i<n->ne;i++) {
+		if(n->e[i].to == to) {
+			if(cost > n->e[i].cost) n->e[i].cost = cost;
+			return;
+		}
+	}
+	if(n->ne == n->cap) {
+		n->cap = n->cap ? n->cap * 2 : 4;
+		n->e = realloc(n->e, n->cap * sizeof(struct edge));
+	}
+	n->e[n->ne].to = to;
+	n->e[n->ne].cost = cost;
+	n->ne++;
+}
+
+// instruction at a byte address, -1 if none starts there
+static int insn_index(const struct insn *in, int n, uint32_t addr)
+{
+	int lo = 0, hi = n - 1, mid;
+
+	while(lo <= hi) {
+		mid = (lo + hi) / 2;
+		if(in[mid].addr == addr) return mid;
+		if(in[mid].addr < addr) lo = mid + 1;
+		else hi = mid - 1;
+	}
+	return -1;
+}
+
+// -mcall-prologues: ldi r30, ldi r31 with the word address to come back
+// to, then jmp __prologue_saves__ which ends in ijmp
+static uint32_t z_before(const struct insn *in, int i)
+{
+	uint16_t w1, w2;
+
+	if(i < 2) return 0;
+	w1 = word_at(in[i-2].addr);
+	w2 = word_at(in[i-1].addr);
+	if((w1 & 0xf0f0) != 0xe0e0 || (w2 & 0xf0f0) != 0xe0f0) return 0;
+	return ((((w2 >> 4) & 0xf0) | (w2 & 0x0f)) << 8 | ((w1 >> 4) & 0xf0) | (w1 & 0x0f)) * 2;
+}
+
+static uint64_t icall_worst(int *unbounded)
+{
+	struct result r;
+	uint64_t worst = 0;
+	int i;
+
+	if(!icall_prefix) return 0;
+	for(i=0;i<nfuncs;i++) {
+		if(strncmp(funcs[i].name, icall_prefix, strlen(icall_prefix))) continue;
+		r = analyse(funcs[i].addr);
+		if(r.cycles > worst) worst = r.cycles;
+		*unbounded |= r.unbounded;
+	}
+	return worst;
+}
+
+// the loops gcc makes for a shift by a variable count: shifts and rotates
+// of one register set, a dec of the count and the branch back. gives the
+// shift instructions, 0 for any other loop
+static int shift_loop(const struct insn *in, const int *rep, int lo, int hi)
+{
+	uint16_t w;
+	int i, d, r, shifts = 0, dec = 0;
+
+	for(i=lo;i<=hi;i++) {
+		if(rep[i] != i) return 0;
+		w = word_at(in[i].addr);
+		d = (w >> 4) & 0x1f;
+		r = (w & 0x0f) | ((w >> 5) & 0x10);
+		if(((w & 0xfc00) == 0x0c00 || (w & 0xfc00) == 0x1c00) && d == r) shifts++;	// lsl, rol
+		else if((w & 0xfe0f) == 0x9406 || (w & 0xfe0f) == 0x9405 || (w & 0xfe0f) == 0x9407) shifts++;	// lsr asr ror
+		else if((w & 0xfe0f) == 0x940a) dec++;
+		else if(i != hi || in[i].kind != I_BRANCH) return 0;
+	}
+	return dec == 1 ? shifts : 0;
+}
+
+// collapses every loop, innermost first, and gives how many there were.
+// without f it only records them in loops, with f it costs them with the
+// bounds loops holds by then
+static int collapse(const struct insn *in, struct node *node, int *rep, int n,
+	int64_t *dist, uint64_t *out, struct loop *loops, const struct func *f, struct result *res)
+{
+	int i, j, k, t, lo, hi, changed, nl;
+	int64_t iter;
+	uint64_t bound;
+
+	// loops, innermost first: each pass takes the shortest range closed
+	// by a back edge that holds no other open range
+	nl = 0;
+	for(;;) {
+		lo = hi = -1;
+		for(i=0;i<n;i++) {
+			if(rep[i] != i) continue;
+			for(k=0;k<node[i].ne;k++) {
+				t = node[i].e[k].to;
+				if(t < 0 || rep[t] > i) continue;
+				t = rep[t];
+				if(lo < 0 || i - t < hi - lo) { lo = t; hi = i; }
+			}
+		}
+		if(lo < 0) break;
+
+		// widen over loops that overlap it without nesting
+		do {
+			changed = 0;
+			for(i=0;i<n;i++) {
+				if(rep[i] != i) continue;
+				for(k=0;k<node[i].ne;k++) {
+					t = node[i].e[k].to;
+					if(t < 0 || rep[t] > i) continue;
+					t = rep[t];
+					if((t < lo && i >= lo && i < hi) || (t > lo && t <= hi && i > hi)) {
+						if(t < lo) lo = t;
+						if(i > hi) hi = i;
+						changed = 1;
+					}
+				}
+			}
+		} while(changed);
+
+		// longest pass from the loop start or any way in
+		for(i=lo;i<=hi;i++) dist[i] = -1;
+		dist[lo] = 0;
+		for(i=0;i<n;i++) {
+			if(rep[i] != i || (i >= lo && i <= hi)) continue;
+			for(k=0;k<node[i].ne;k++) {
+				t = node[i].e[k].to;
+				if(t >= 0 && rep[t] >= lo && rep[t] <= hi) dist[rep[t]] = 0;
+			}
+		}
+
+		iter = 0;
+		for(i=0;i<n+2;i++) out[i] = 0;
+		for(i=lo;i<=hi;i++) {
+			if(rep[i] != i || dist[i] < 0) continue;
+			for(k=0;k<node[i].ne;k++) {
+				t = node[i].e[k].to;
+				if(t >= 0) t = rep[t];
+				if(t >= lo && t <= hi) {
+					if(t > i) { if(dist[i] + (int64_t)node[i].e[k].cost > dist[t]) dist[t] = dist[i] + node[i].e[k].cost; }
+					else if(dist[i] + (int64_t)node[i].e[k].cost > iter) iter = dist[i] + node[i].e[k].cost;
+				}
+				else {
+					j = t >= 0 ? t + 2 : -t - 1;	// out[] index: exits, then nodes
+					if(dist[i] + node[i].e[k].cost > out[j]) out[j] = dist[i] + node[i].e[k].cost;
+				}
+			}
+		}
+
+		if(!f) {
+			loops[nl].lo = lo;
+			loops[nl].hi = hi;
+			loops[nl].parent = -1;
+			loops[nl].shifts = shift_loop(in, rep, lo, hi);
+			for(k=0;k<nl;k++)
+				if(loops[k].parent < 0 && rep[loops[k].lo] >= lo && rep[loops[k].lo] <= hi) loops[k].parent = nl;
+			bound = 1;
+		}
+		else {
+			bound = loops[nl].bound;
+			if(!bound) { bound = 1; res->unbounded = 1; }
+		}
+		nl++;
+
+		// collapse into the first node
+		node[lo].ne = 0;
+		for(j=0;j<n+2;j++) {
+			if(!out[j]) continue;
+			add_edge(&node[lo], j >= 2 ? j - 2 : -j - 1, bound * iter + out[j]);
+		}
+		for(i=lo;i<n;i++) if(rep[i] >= lo && rep[i] <= hi) rep[i] = lo;
+	}
+
+	return nl;
+}
+
+static struct result analyse(uint32_t entry)
+{
+	struct result res, r;
+	struct func *f;
+	struct insn *in;
+	struct node *node;
+	struct node *copy;
+	struct loop *loops;
+	int *rep, n, i, j, k, first, t, nl, depth;
+	int64_t *dist;
+	uint64_t *out;
+	uint32_t a;
+
+	memset(&res, 0, sizeof(res));
+	if(memo[entry - text_addr].done) return memo[entry - text_addr];
+	if(memo[entry - text_addr].busy) return res;		// recursion: counted once
+	memo[entry - text_addr].busy = 1;
+
+	f = func_at(entry);
+	if(!f) {
+		memo[entry - text_addr].busy = 0;
+		return res;
+	}
+
+	// instructions from the function start, so entries into the middle
+	// (call prologues) decode on the same boundaries
+	in = calloc(f->size / 2 + 1, sizeof(struct insn));
+	for(n=0,a=f->addr;a<f->addr+f->size;n++) {
+		decode(a, &in[n]);
+		a += in[n].words * 2;
+	}
+
+	node = calloc(n, sizeof(struct node));
+	rep = malloc(n * sizeof(int));
+	dist = malloc(n * sizeof(int64_t));
+	out = malloc((n + 2) * sizeof(uint64_t));
+
+	first = insn_index(in, n, entry);
+	if(first < 0) first = 0;
+
+	// edges, with calls folded in
+	for(i=0;i<n;i++) {
+		rep[i] = i;
+		t = i + 1 < n ? i + 1 : EXIT_RET;
+
+		switch(in[i].kind) {
+		case I_PLAIN:
+			add_edge(&node[i], t, in[i].cycles);
+			break;
+		case I_BRANCH:
+			add_edge(&node[i], t, 1);
+			j = insn_index(in, n, in[i].target);
+			add_edge(&node[i], j >= 0 ? j : EXIT_RET, 2);
+			break;
+		case I_SKIP:
+			add_edge(&node[i], t, 1);
+			if(i + 2 < n) add_edge(&node[i], i + 2, i + 1 < n && in[i+1].words == 2 ? 3 : 2);
+			else add_edge(&node[i], EXIT_RET, 3);
+			break;
+		case I_JUMP:
+			j = insn_index(in, n, in[i].target);
+			if(in[i].target >= f->addr && in[i].target < f->addr + f->size && j >= 0) {
+				add_edge(&node[i], j, in[i].cycles);
+				break;
+			}
+			// tail call, or a call prologue coming back through ijmp to z
+			r = analyse(in[i].target);
+			res.unbounded |= r.unbounded;
+			j = r.via_ijmp ? insn_index(in, n, z_before(in, i)) : -1;
+			if(r.via_ijmp && j >= 0) add_edge(&node[i], j, in[i].cycles + r.cycles);
+			else add_edge(&node[i], r.via_ijmp ? EXIT_IJMP : EXIT_RET, in[i].cycles + r.cycles);
+			break;
+		case I_CALL:
+			r = analyse(in[i].target);
+			res.unbounded |= r.unbounded;
+			add_edge(&node[i], t, in[i].cycles + r.cycles);
+			break;
+		case I_ICALL:
+			k = 0;
+			add_edge(&node[i], t, in[i].cycles + icall_worst(&k));
+			res.unbounded |= k;
+			break;
+		case I_IJMP:
+			add_edge(&node[i], EXIT_IJMP, in[i].cycles);
+			break;
+		case I_RET:
+			add_edge(&node[i], EXIT_RET, in[i].cycles);
+			break;
+		}
+
+	}
+
+	// the loops and how they nest, on a copy the first run can collapse
+	copy = calloc(n, sizeof(struct node));
+	for(i=0;i<n;i++) {
+		copy[i].ne = copy[i].cap = node[i].ne;
+		copy[i].e = malloc((node[i].ne + 1) * sizeof(struct edge));
+		memcpy(copy[i].e, node[i].e, node[i].ne * sizeof(struct edge));
+	}
+	loops = calloc(n + 1, sizeof(struct loop));
+	nl = collapse(in, copy, rep, n, dist, out, loops, NULL, &res);
+	for(i=0;i<n;i++) {
+		free(copy[i].e);
+		rep[i] = i;
+	}
+	free(copy);
+
+	// each loop takes its level's bound. shift loops past the levels
+	// given bound themselves, other loops there are an error
+	for(i=0;i<nl;i++) {
+		for(depth=0,j=loops[i].parent;j>=0;j=loops[j].parent) depth++;
+		if(depth < f->nest) loops[i].bound = f->loops[depth];
+		else if(loops[i].shifts) loops[i].bound = 8 * loops[i].shifts;
+		else if(f->nest) {
+			fprintf(stderr, "%s: loop at 0x%04x is nested %d deep, LOOPS_%s gives %d level%s\n",
+				f->name, in[loops[i].lo].addr, depth + 1, f->name, f->nest, f->nest > 1 ? "s" : "");
+			errors++;
+		}
+	}
+	collapse(in, node, rep, n, dist, out, loops, f, &res);
+	free(loops);
+
+	// the longest way from the entry to an exit
+	for(i=0;i<n;i++) dist[i] = -1;
+	dist[rep[first]] = 0;
+	for(i=0;i<n;i++) {
+		if(rep[i] != i || dist[i] < 0) continue;
+		for(k=0;k<node[i].ne;k++) {
+			t = node[i].e[k].to;
+			if(t >= 0) {
+				t = rep[t];
+				if(t > i && dist[i] + (int64_t)node[i].e[k].cost > dist[t]) dist[t] = dist[i] + node[i].e[k].cost;
+			}
+			else {
+				if(dist[i] + node[i].e[k].cost > res.cycles) res.cycles = dist[i] + node[i].e[k].cost;
+				res.returns = 1;
+				if(t == EXIT_IJMP) res.via_ijmp = 1;
+			}
+		}
+	}
+
+	for(i=0;i<n;i++) free(node[i].e);
+	free(node); free(rep); free(dist); free(out); free(in);
+
+	res.done = 1;
+	memo[entry - text_addr] = res;
+	return res;
+}
+
+
+// stack: frames from .su plus a return address per call level
+// ===============================================================
+static int stack_busy[MAX_FUNCS];
+
+static int stack_worst(struct func *f)
+{
+	struct insn in;
+	struct func *c;
+	uint32_t a;
+	int worst = 0, s, i;
+
+	if(stack_busy[f - funcs]) return 0;
+	stack_busy[f - funcs] = 1;
+
+	for(a=f->addr;a<f->addr+f->size;a+=in.words*2) {
+		decode(a, &in);
+		c = NULL;
+		if(in.kind == I_CALL) c = func_at(in.target);
+		else if(in.kind == I_JUMP && (in.target < f->addr || in.target >= f->addr + f->size)) c = func_at(in.target);
+		if(c) {
+			s = stack_worst(c) + (in.kind == I_CALL ? 2 : 0);
+			if(s > worst) worst = s;
+		}
+		if(in.kind == I_ICALL && icall_prefix) {
+			for(i=0;i<nfuncs;i++) {
+				if(strncmp(funcs[i].name, icall_prefix, strlen(icall_prefix))) continue;
+				s = stack_worst(&funcs[i]) + 2;
+				if(s > worst) worst = s;
+			}
+		}
+	}
+
+	stack_busy[f - funcs] = 0;
+	return worst + (f->stack > 0 ? f->stack : 0);
+}
+
+
+// inputs
+// ===============================================================
+// budget "NAME" symbol cycles, loops "NAME" symbol passes, ... the
+// values are what the preprocessor left of the mk.c macros, so a little
+// arithmetic is evaluated here: + - * / << >> ?: ( ) and U/L suffixes.
+static const char *expr_p;
+static int64_t expr_cond(void);
+
+static int64_t expr_atom(void)
+{
+	int64_t v;
+
+	while(*expr_p == ' ') expr_p++;
+	if(*expr_p == '(') {
+		expr_p++;
+		v = expr_cond();
+		while(*expr_p == ' ') expr_p++;
+		if(*expr_p == ')') expr_p++;
+		return v;
+	}
+	if(*expr_p == '-') { expr_p++; return -expr_atom(); }
+	v = strtoll(expr_p, (char **)&expr_p, 0);
+	while(*expr_p == 'U' || *expr_p == 'u' || *expr_p == 'L' || *expr_p == 'l') expr_p++;
+	return v;
+}
+
+static int64_t expr_product(void)
+{
+	int64_t v = expr_atom();
+
+	for(;;) {
+		while(*expr_p == ' ') expr_p++;
+		if(*expr_p == '*') { expr_p++; v *= expr_atom(); }
+		else if(*expr_p == '/') { expr_p++; v /= expr_atom(); }
+		else return v;
+	}
+}
+
+static int64_t expr_sum(void)
+{
+	int64_t v = expr_product();
+
+	for(;;) {
+		while(*expr_p == ' ') expr_p++;
+		if(*expr_p == '+') { expr_p++; v += expr_product(); }
+		else if(*expr_p == '-') { expr_p++; v -= expr_product(); }
+		else if(!strncmp(expr_p, "<<", 2)) { expr_p += 2; v <<= expr_product(); }
+		else if(!strncmp(expr_p, ">>", 2)) { expr_p += 2; v >>= expr_product(); }
+		else return v;
+	}
+}
+
+static int64_t expr_cond(void)
+{
+	int64_t v = expr_sum(), a, b;
+
+	while(*expr_p == ' ') expr_p++;
+	if(*expr_p != '?') return v;
+	expr_p++;
+	a = expr_cond();
+	while(*expr_p == ' ') expr_p++;
+	if(*expr_p == ':') expr_p++;
+	b = expr_cond();
+	return v ? a : b;
+}
+
+static void load_budget(const char *path)
+{
+	FILE *f;
+	char line[512], kind[16], label[64], symbol[64];
+	struct func *fn;
+	int used;
+
+	if(!(f = fopen(path, "r"))) { perror(path); exit(2); }
+	while(fgets(line, sizeof(line), f)) {
+		if(sscanf(line, "%15s \"%63[^\"]\" %63s %n", kind, label, symbol, &used) != 3) continue;
+		expr_p = line + used;
+
+		// loops of functions gcc inlined count toward their caller's bound
+		fn = func_named(symbol);
+		if(!fn) {
+			if(!strcmp(kind, "budget")) {
+				fprintf(stderr, "%s: %s (%s) not in the elf\n", path, label, symbol);
+				errors++;
+			}
+			continue;
+		}
+		if(!strcmp(kind, "budget")) {
+			fn->label = strdup(label);
+			fn->period = expr_cond();
+		}
+		else if(!strcmp(kind, "loops")) {
+			for(fn->nest=0;fn->nest<MAX_NEST;) {
+				fn->loops[fn->nest++] = expr_cond();
+				while(*expr_p == ' ') expr_p++;
+				if(*expr_p++ != ',') break;
+			}
+		}
+	}
+	fclose(f);
+}
+
+// lines of "file:line:col:name	bytes	kind"
+static void load_su(const char *path)
+{
+	FILE *f;
+	char line[512], *name, *tab;
+	struct func *fn;
+
+	if(!(f = fopen(path, "r"))) { perror(path); exit(2); }
+	while(fgets(line, sizeof(line), f)) {
+		tab = strchr(line, '\t');
+		if(!tab) continue;
+		*tab = 0;
+		name = strrchr(line, ':');
+		name = name ? name + 1 : line;
+		if((fn = func_named(name))) fn->stack = atoi(tab + 1);
+	}
+	fclose(f);
+}
+
+
+// ===============================================================
+int main(int argc, char **argv)
+{
+	struct result r, worst_isr;
+	struct func *f;
+	const char *name;
+	uint64_t cycles, others;
+	int i, j, arg, failed;
+
+	arg = 1;
+	if(arg + 1 < argc && !strcmp(argv[arg], "-t")) {
+		icall_prefix = argv[arg+1];
+		arg += 2;
+	}
+	if(argc - arg < 2) {
+		fprintf(stderr, "usage: budget [-t prefix] mk.elf mk.budget [file.su ...]\n");
+		return 2;
+	}
+
+	load_elf(argv[arg]);
+	memo = calloc(text_size + 2, sizeof(struct result));
+	load_budget(argv[arg+1]);
+	for(i=arg+2;i<argc;i++) load_su(argv[i]);
+
+	printf("%-28s %10s %6s\n", "function", "cycles", "stack");
+	for(i=0;i<nfuncs;i++) {
+		f = &funcs[i];
+		if(f->name[0] == '_' && !f->period) continue;	// library code
+		r = analyse(f->addr);
+		cycles = r.cycles + (f->period ? ISR_ENTRY_CYCLES : 0);
+		name = f->label ? f->label : f->name;
+		if(r.returns) printf("%-28s %10" PRIu64 "%s", name, cycles, r.unbounded ? "?" : " ");
+		else printf("%-28s %10s ", name, "-");
+		printf(" %5d\n", stack_worst(f) + (f->period ? 2 : 0));
+	}
+
+	// an interrupt can also wait for the longest other one to finish
+	printf("\n%-28s %10s %10s %10s %6s\n", "interrupt", "period", "worst", "+ blocked", "load");
+	failed = 0;
+	for(i=0;i<nfuncs;i++) {
+		f = &funcs[i];
+		if(!f->period) continue;
+		r = analyse(f->addr);
+		cycles = r.cycles + ISR_ENTRY_CYCLES;
+
+		others = 0;
+		for(j=0;j<nfuncs;j++) {
+			if(j == i || !funcs[j].period) continue;
+			worst_isr = analyse(funcs[j].addr);
+			if(worst_isr.cycles + ISR_ENTRY_CYCLES > others) others = worst_isr.cycles + ISR_ENTRY_CYCLES;
+		}
+
+		printf("%-28s %10u %10" PRIu64 " %10" PRIu64 " %5.1f%%%s\n", f->label, f->period, cycles,
+			cycles + others, 100.0 * cycles / f->period,
+			r.unbounded ? "  unbounded loop" : cycles > f->period ? "  OVER PERIOD" : "");
+		if(r.unbounded || cycles > f->period) failed = 1;
+	}
+
+	return failed || errors;
+}
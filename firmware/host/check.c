@@ -0,0 +1,785 @@
+/************************************************************************
+host regression checks
+*************************************************************************
+runs one firmware variant against the simulated board and checks the
+protocol replies, the led driver registers and the key events.
+
+usage: check <variant>
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include "port.h"
+#include "button.h"
+
+static const char *variant;
+static int checks, failures;
+
+static uint8_t size_x, size_y, chains;
+static uint8_t key_x[4][8][8], key_y[4][8][8];	// where check_keys saw each key
+
+#define CHECK(cond, ...) do { \
+	checks++; \
+	if(!(cond)) { \
+		failures++; \
+		printf("%s: %s:%d: ", variant, __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+	} \
+} while(0)
+
+
+// helpers
+// ===============================================================
+static void send(const uint8_t *data, uint32_t len)
+{
+	sim_usb_feed(data, len);
+	sim_drain();
+}
+
+static uint32_t reply(uint8_t *data, uint32_t max)
+{
+	return sim_usb_take(data, max);
+}
+
+extern volatile uint16_t bam_frames __attribute__((weak));
+
+// the digits every chain shows now, leaving out the control registers
+// (varibright moves the intensity on every bam slot)
+static int digits_match(uint8_t want[4][16])
+{
+	uint8_t q;
+
+	for(q=0;q<4;q++)
+		if(memcmp(want[q] + 1, sim.led_reg[q] + 1, 8)) return 0;
+	return 1;
+}
+
+static uint32_t lit(void)
+{
+	uint32_t n = 0;
+	uint8_t q, d, v;
+
+	for(q=0;q<4;q++)
+		for(d=1;d<9;d++)
+			for(v=sim.led_reg[q][d];v;v>>=1) n += v & 1;
+	return n;
+}
+
+// run keypad scans until a packet shows up, returns scans or 0
+static uint32_t wait_packet(uint8_t *ev, uint32_t len, uint32_t max_scans)
+{
+	uint32_t n;
+
+	for(n=1;n<=max_scans;n++) {
+		sim_tick();
+		if(sim.tx_count - sim.tx_read >= len) {
+			reply(ev, len);
+			return n;
+		}
+	}
+	return 0;
+}
+
+static uint32_t wait_event(uint8_t *ev, uint32_t max_scans)
+{
+	return wait_packet(ev, 3, max_scans);
+}
+
+// a _KEY_ROW/_KEY_COL packet covers key x,y
+static uint8_t key_in(const uint8_t *p, uint8_t x, uint8_t y)
+{
+	if(p[0] == 0x22) return y == p[2] && x >= p[1] && x < p[1] + 8 && (p[3] >> (x - p[1]) & 1);
+	if(p[0] == 0x23) return x == p[1] && y >= p[2] && y < p[2] + 8 && (p[3] >> (y - p[2]) & 1);
+	return 0;
+}
+
+
+// checks
+// ===============================================================
+static void check_boot(void)
+{
+	uint8_t q, d;
+
+	for(q=0;q<4;q++) {
+		CHECK(sim.led_reg[q][10] == 15, "chain %d intensity %d", q, sim.led_reg[q][10]);
+		CHECK(sim.led_reg[q][11] == 7, "chain %d scan limit %d", q, sim.led_reg[q][11]);
+		CHECK(sim.led_reg[q][12] == 1, "chain %d shutdown %d", q, sim.led_reg[q][12]);
+		for(d=1;d<9;d++)
+			CHECK(sim.led_reg[q][d] == 0, "chain %d digit %d not clear", q, d);
+	}
+}
+
+static void check_sys(void)
+{
+	uint8_t b[64];
+	uint32_t n;
+
+	send((const uint8_t []) { 0x00 }, 1);
+	n = reply(b, sizeof(b));
+	CHECK(n >= 6 && n % 3 == 0, "query reply length %u", n);
+	CHECK(b[0] == 0x00 && b[1] == 1 && b[2] > 0, "query reply");
+
+	send((const uint8_t []) { 0x01 }, 1);
+	n = reply(b, sizeof(b));
+	CHECK(n == 33, "id reply length %u", n);
+	CHECK(b[0] == 0x01 && !strcmp((char *)b + 1, "mk"), "id reply");
+
+	send((const uint8_t []) { 0x05 }, 1);
+	n = reply(b, sizeof(b));
+	CHECK(n == 3 && b[0] == 0x03, "grid size reply");
+	size_x = b[1];
+	size_y = b[2];
+	chains = (size_x / 8) * (size_y / 8);
+	CHECK(chains >= 1 && chains <= 4, "grid size %dx%d", size_x, size_y);
+
+	// bytes with no packet length are skipped
+	send((const uint8_t []) { 0x0b, 0x0c, 0x05 }, 3);
+	n = reply(b, sizeof(b));
+	CHECK(n == 3 && b[0] == 0x03, "resync after unknown bytes");
+}
+
+// driver digit r + 1, bit c of chain q that shows x, y of its quadrant,
+// also keypad row r, bit c. 40h tiles are turned to face the middle
+static void quadrant_cell(uint8_t q, uint8_t x, uint8_t y, uint8_t *r, uint8_t *c)
+{
+#if ROTATE_40H
+	switch(q) {
+	case 0: *r = 7 - y; *c = 7 - x; break;
+	case 1: *r = x; *c = 7 - y; break;
+	case 2: *r = 7 - x; *c = y; break;
+	default: *r = y; *c = x; break;
+	}
+#else
+	*r = 7 - x;
+	*c = y;
+#endif
+}
+
+static void check_leds(void)
+{
+	uint8_t x, y, q, d, r, c, top[4];
+	uint8_t p[11];
+
+	send((const uint8_t []) { 0x13 }, 1);
+	CHECK(lit() == 256, "all on lit %u", lit());
+	send((const uint8_t []) { 0x12 }, 1);
+	CHECK(lit() == 0, "all off lit %u", lit());
+
+	for(x=0;x<size_x;x++) {
+		for(y=0;y<size_y;y++) {
+			send((const uint8_t []) { 0x11, x, y }, 3);
+			CHECK(lit() == 1, "set %d,%d lit %u", x, y, lit());
+			q = (x >> 3) + (y >> 3) * 2;
+			quadrant_cell(q, x & 7, y & 7, &r, &c);
+			CHECK(sim.led_reg[q][r + 1] == 1 << c, "set %d,%d at chain %d digit %d", x, y, q, r + 1);
+			send((const uint8_t []) { 0x10, x, y }, 3);
+			CHECK(lit() == 0, "clear %d,%d lit %u", x, y, lit());
+		}
+	}
+
+	// one quadrant map with a checkerboard
+	p[0] = 0x14; p[1] = 0; p[2] = 0;
+	for(d=0;d<8;d++) p[d+3] = d & 1 ? 0xaa : 0x55;
+	send(p, 11);
+	CHECK(lit() == 32, "map lit %u", lit());
+
+	// a row and a column cross in one led
+	send((const uint8_t []) { 0x12 }, 1);
+	send((const uint8_t []) { 0x15, 0, 3, 0xff }, 4);
+	CHECK(lit() == 8, "row lit %u", lit());
+	send((const uint8_t []) { 0x16, 5, 0, 0xff }, 4);
+	CHECK(lit() == 15, "row + col lit %u", lit());
+	send((const uint8_t []) { 0x16, 5, 0, 0x00 }, 4);
+	CHECK(lit() == 7, "col clear lit %u", lit());
+	send((const uint8_t []) { 0x12 }, 1);
+
+	// varibright shows plane 3 at the host's intensity, the others lower,
+	// so the brightest over a bam period
+	send((const uint8_t []) { 0x17, 0x07 }, 2);
+	for(q=0;q<4;q++) top[q] = sim.led_reg[q][10];
+	if(&bam_frames)
+		for(d=bam_frames;(uint8_t)(bam_frames - d) < 2;) {
+			sim_loop();
+			for(q=0;q<4;q++)
+				if(sim.led_reg[q][10] > top[q]) top[q] = sim.led_reg[q][10];
+		}
+	for(q=0;q<4;q++) CHECK(top[q] == 7, "intensity chain %d at %d", q, top[q]);
+	send((const uint8_t []) { 0x17, 0x0f }, 2);
+}
+
+// a map must light what the same leds set one by one light, also when
+// its bytes trickle in one per main loop pass
+static void check_map(void)
+{
+	uint8_t q, x, y, i, p[11], want[4][16];
+
+	for(q=0;q<chains;q++) {
+		p[0] = 0x14; p[1] = (q & 1) * 8; p[2] = (q >> 1) * 8;
+		for(y=0;y<8;y++) p[y+3] = 0x35 * (y + 1) + q;
+
+		send((const uint8_t []) { 0x12 }, 1);
+		for(y=0;y<8;y++)
+			for(x=0;x<8;x++)
+				if(p[y+3] & (1 << x))
+					send((const uint8_t []) { 0x11, p[1] + x, p[2] + y }, 3);
+		memcpy(want, sim.led_reg, sizeof(want));
+
+		send((const uint8_t []) { 0x12 }, 1);
+		for(i=0;i<11;i++) {
+			sim_usb_feed(p + i, 1);
+			sim_loop();
+		}
+		sim_drain();
+		CHECK(digits_match(want), "map quadrant %d", q);
+	}
+	send((const uint8_t []) { 0x12 }, 1);
+}
+
+// row and column packets must match the same leds set one by one, over
+// a lit quadrant as well as a dark one
+static void check_lines(void)
+{
+	uint8_t q, l, i, col, on, x, y, bits, want[4][16];
+
+	for(q=0;q<chains;q++) {
+		for(l=0;l<16;l++) {
+			col = l >> 3;
+			on = (l >> 1) & 1;
+			bits = 0x35 * (l + 1) + q;
+			x = (q & 1) * 8 + (col ? l & 7 : 0);
+			y = (q >> 1) * 8 + (col ? 0 : l & 7);
+
+			send((const uint8_t []) { on ? 0x13 : 0x12 }, 1);
+			for(i=0;i<8;i++)
+				if((bits >> i & 1) != on)
+					send((const uint8_t []) { on ? 0x10 : 0x11, x + (col ? 0 : i), y + (col ? i : 0) }, 3);
+			memcpy(want, sim.led_reg, sizeof(want));
+
+			send((const uint8_t []) { on ? 0x13 : 0x12 }, 1);
+			send((const uint8_t []) { col ? 0x16 : 0x15, x, y, bits }, 4);
+			CHECK(digits_match(want), "%s %d,%d %02x over %s",
+				col ? "col" : "row", x, y, bits, on ? "lit" : "dark");
+		}
+	}
+	send((const uint8_t []) { 0x12 }, 1);
+}
+
+// varibright firmwares only: each led's light, its lit time at the
+// driver's intensity, over whole bam periods must follow its 4 bit level
+
+static double glow_rate(uint8_t x, uint8_t y, uint16_t frames)
+{
+	uint64_t start = sim.cycles, g = sim_led_glow(0, 8 - x, y);
+	uint16_t i;
+
+	for(i=bam_frames;(uint16_t)(bam_frames - i) < frames;) sim_loop();
+	return (double)(sim_led_glow(0, 8 - x, y) - g) / (32.0 * (sim.cycles - start));
+}
+
+static void check_varibright(void)
+{
+	uint8_t x, y, i, p[35];
+	uint64_t glow[8][8], lit[8][8], start, now, run, longest;
+	uint32_t slot;
+	double level, full, dim;
+
+	if(!&bam_frames) return;
+
+	p[0] = 0x1a; p[1] = 0; p[2] = 0;
+	for(y=0;y<8;y++)
+		for(i=0;i<4;i++)
+			p[3+y*4+i] = ((2*i + y*8) & 15) << 4 | ((2*i + 1 + y*8) & 15);
+	send(p, 35);
+
+	for(i=bam_frames;(uint16_t)(bam_frames - i) < 2;) sim_loop();
+	start = sim.cycles;
+	for(x=0;x<8;x++)
+		for(y=0;y<8;y++) glow[x][y] = sim_led_glow(0, 8 - x, y);
+
+	// levels against level 15 (7,1), which is about half of full on
+	// since the planes take turns
+	for(i=bam_frames;(uint16_t)(bam_frames - i) < 32;) sim_loop();
+	full = (double)(sim_led_glow(0, 1, 1) - glow[7][1]) / (32.0 * (sim.cycles - start));
+	CHECK(full > 0.4, "level 15 lit %.3f of full", full);
+	for(x=0;x<8;x++) {
+		for(y=0;y<8;y++) {
+			level = (double)(sim_led_glow(0, 8 - x, y) - glow[x][y]) / (32.0 * (sim.cycles - start)) / full;
+			CHECK(level > ((x + y*8) & 15) / 15.0 - 0.03 && level < ((x + y*8) & 15) / 15.0 + 0.03,
+				"level %d at %d,%d lit %.3f of level 15", (x + y*8) & 15, x, y, level);
+		}
+	}
+
+	// a slot lasts a max7219 scan, a period is 4 of them (200Hz), and
+	// level 8 (0,1) shows in a single slot of each
+	slot = ((uint32_t)OCR1A + 1) * 8;
+	CHECK(slot >= 16000000 / 800, "bam slot of %u cycles is shorter than a max7219 scan", slot);
+	CHECK((sim.cycles - start) / 32 <= 16000000 / 190, "bam period of %.2fms",
+		(double)(sim.cycles - start) / 32 / 16000);
+	run = longest = 0;
+	lit[0][1] = sim_led_lit(0, 8, 1);
+	for(i=bam_frames;(uint16_t)(bam_frames - i) < 4;) {
+		start = sim.cycles;
+		sim_loop();
+		now = sim_led_lit(0, 8, 1);
+		run = now != lit[0][1] ? run + sim.cycles - start : 0;
+		if(run > longest) longest = run;
+		lit[0][1] = now;
+	}
+	CHECK(longest <= slot + slot / 4, "level 8 lit %.2f slots at once", (double)longest / slot);
+
+	// _LED_INT dims every plane
+	send((const uint8_t []) { 0x17, 7 }, 2);
+	for(i=bam_frames;(uint16_t)(bam_frames - i) < 2;) sim_loop();
+	dim = glow_rate(7, 1, 16) / full;
+	CHECK(dim > 0.35 && dim < 0.6, "intensity 7 lit level 15 %.3f of intensity 15", dim);
+	send((const uint8_t []) { 0x17, 15 }, 2);
+
+	// plain on/off packets still switch a dimmed led fully
+	send((const uint8_t []) { 0x10, 3, 0 }, 3);
+	send((const uint8_t []) { 0x11, 4, 0 }, 3);
+	start = sim.cycles;
+	lit[3][0] = sim_led_lit(0, 5, 0);
+	lit[4][0] = sim_led_lit(0, 4, 0);
+	for(i=bam_frames;(uint16_t)(bam_frames - i) < 4;) sim_loop();
+	CHECK(sim_led_lit(0, 5, 0) == lit[3][0], "set0 leaves a dimmed led lit");
+	CHECK(sim_led_lit(0, 4, 0) - lit[4][0] == sim.cycles - start, "set1 leaves a led dimmed");
+
+	send((const uint8_t []) { 0x12 }, 1);
+}
+
+static void check_keys(void)
+{
+	uint8_t c, r, k, qr, qc, ev[3];
+	uint8_t seen[16][16];
+	uint32_t n;
+
+	memset(seen, 0, sizeof(seen));
+
+	for(c=0;c<chains;c++) {
+		for(r=0;r<8;r++) {
+			for(k=0;k<8;k++) {
+				sim_key(c, r, k, 1);
+				n = wait_event(ev, 16);
+				CHECK(n && ev[0] == 0x21, "press %d/%d/%d", c, r, k);
+				if(n && ev[1] < 16 && ev[2] < 16) {
+					CHECK(!seen[ev[1]][ev[2]], "press %d/%d/%d repeats %d,%d", c, r, k, ev[1], ev[2]);
+					seen[ev[1]][ev[2]] = 1;
+					key_x[c][r][k] = ev[1];
+					key_y[c][r][k] = ev[2];
+				}
+				quadrant_cell(c, ev[1] & 7, ev[2] & 7, &qr, &qc);
+				CHECK((ev[1] >> 3) + (ev[2] >> 3) * 2 == c && qr == r && qc == k,
+					"press %d/%d/%d reported at %d,%d", c, r, k, ev[1], ev[2]);
+				sim_key(c, r, k, 0);
+				n = wait_event(ev, 8 * (kButtonUpDefaultDebounceCount + 2));
+				CHECK(n && ev[0] == 0x20, "release %d/%d/%d", c, r, k);
+			}
+		}
+	}
+
+	CHECK(sim.tx_count == sim.tx_read, "unexpected trailing output");
+}
+
+// a bounce during the release count restarts it, with no extra events
+static void check_debounce(void)
+{
+	uint8_t ev[3];
+	uint32_t n, wait;
+
+	wait = 8 * (kButtonUpDefaultDebounceCount + 2);
+
+	sim_key(0, 2, 5, 1);
+	CHECK(wait_event(ev, 16) && ev[0] == 0x21, "bounce press");
+	sim_key(0, 2, 5, 0);
+	wait_event(ev, 8 * (kButtonUpDefaultDebounceCount / 2));
+	CHECK(sim.tx_count == sim.tx_read, "bounce released early");
+
+	sim_key(0, 2, 5, 1);
+	CHECK(!wait_event(ev, 16), "bounce press reported twice");
+	sim_key(0, 2, 5, 0);
+	n = wait_event(ev, wait);
+	CHECK(n && ev[0] == 0x20, "bounce release");
+	CHECK(n > 8 * (kButtonUpDefaultDebounceCount - 1), "bounce release after %u scans", n);
+	CHECK(!wait_event(ev, wait), "bounce trailing event");
+}
+
+// row reports: a single key must expand to exactly the key check_keys
+// saw, a chord on one register row arrives as one packet
+static void check_key_rows(void)
+{
+	uint8_t c, k, x, y, p[4];
+	uint32_t n, wait, bits;
+
+	wait = 8 * (kButtonUpDefaultDebounceCount + 2);
+	send((const uint8_t []) { 0x0e, 1 }, 2);
+
+	for(c=0;c<chains;c++) {
+		sim_key(c, 6, 1, 1);
+		n = wait_packet(p, 4, 16);
+		CHECK(n && (p[0] == 0x22 || p[0] == 0x23), "row press %d", c);
+		for(bits=0,x=0;x<size_x;x++)
+			for(y=0;y<size_y;y++) bits += key_in(p, x, y);
+		CHECK(bits == 1 && key_in(p, key_x[c][6][1], key_y[c][6][1]),
+			"row press %d at %d,%d bits %02x", c, p[1], p[2], p[3]);
+
+		sim_key(c, 6, 1, 0);
+		n = wait_packet(p, 4, wait);
+		CHECK(n && (p[0] == 0x22 || p[0] == 0x23) && p[3] == 0, "row release %d", c);
+	}
+
+	for(k=0;k<8;k++) sim_key(chains - 1, 2, k, 1);
+	n = wait_packet(p, 4, 16);
+	CHECK(n && p[3] == 0xff, "chord %02x", p[3]);
+	for(k=0;k<8;k++) sim_key(chains - 1, 2, k, 0);
+	n = wait_packet(p, 4, wait);
+	CHECK(n && p[3] == 0, "chord release %02x", p[3]);
+	CHECK(!wait_packet(p, 1, wait), "chord trailing output");
+
+	send((const uint8_t []) { 0x0e, 0 }, 2);
+	sim_key(0, 0, 0, 1);
+	CHECK(wait_event(p, 16) && p[0] == 0x21, "key mode off");
+	sim_key(0, 0, 0, 0);
+	wait_event(p, wait);
+}
+
+// stamped events: the press leaves in the scan tick that saw it, the
+// release's sampled stamp goes back over the debounce count. sent also
+// carries timer0's count into the tick, under one period
+static void check_key_stamps(void)
+{
+	uint8_t p[7];
+	uint16_t sampled, sent, period;
+	uint32_t n, wait;
+
+	wait = 8 * (kButtonUpDefaultDebounceCount + 2);
+	send((const uint8_t []) { 0x0e, 2 }, 2);
+
+	sim_key(0, 3, 4, 1);
+	n = wait_packet(p, 7, 16);
+	period = sim_timer0_period_us() / 16;		// the fast rate, once a key is down
+	sampled = p[3] | p[4] << 8;
+	sent = p[5] | p[6] << 8;
+	CHECK(n && p[0] == 0x25 && p[1] == key_x[0][3][4] && p[2] == key_y[0][3][4],
+		"stamped press %02x %d,%d", p[0], p[1], p[2]);
+	CHECK((uint16_t)(sent - sampled) < period, "stamped press sampled %u sent %u", sampled, sent);
+
+	sim_key(0, 3, 4, 0);
+	n = wait_packet(p, 7, wait);
+	sampled = p[3] | p[4] << 8;
+	sent = p[5] | p[6] << 8;
+	CHECK(n && p[0] == 0x24 && p[1] == key_x[0][3][4] && p[2] == key_y[0][3][4], "stamped release");
+	CHECK((uint16_t)(sent - sampled) / period == kButtonUpDefaultDebounceCount * 8,
+		"stamped release %u after its edge, %u scans", (uint16_t)(sent - sampled) / period, n);
+	CHECK(!wait_packet(p, 1, wait), "stamped trailing output");
+
+	send((const uint8_t []) { 0x0e, 0 }, 2);
+}
+
+// _SYS_GET_COUNTERS: packets and bytes between two queries, and the
+// scan rate over a whole second of ticks
+extern volatile uint16_t aux_dropped __attribute__((weak));
+
+static void check_counters(void)
+{
+	static const uint8_t all0[] = { 0x12 };
+	static const uint8_t get[] = { 0x09 };
+	uint8_t p[28], q[28];
+	uint32_t n, bytes, packets, scans;
+
+	send(get, 1);
+	CHECK(reply(p, 28) == 28 && p[0] == 0x06, "counters reply %02x", p[0]);
+	for(n=0;n<10;n++) send(all0, 1);
+	send(get, 1);
+	CHECK(reply(q, 28) == 28 && q[0] == 0x06, "second counters reply %02x", q[0]);
+
+	bytes = (q[1] | q[2] << 8 | q[3] << 16 | (uint32_t)q[4] << 24) -
+		(p[1] | p[2] << 8 | p[3] << 16 | (uint32_t)p[4] << 24);
+	packets = (q[5] | q[6] << 8 | q[7] << 16 | (uint32_t)q[8] << 24) -
+		(p[5] | p[6] << 8 | p[7] << 16 | (uint32_t)p[8] << 24);
+	CHECK(bytes == 11 && packets == 11, "counted %u bytes %u packets, sent 11", bytes, packets);
+
+	// bytes no packet starts with are resyncs, not packets
+	send((const uint8_t []) { 0x13, 0x0b, 0x0b, 0x0b, 0x09 }, 5);
+	CHECK(reply(p, 28) == 28 && p[0] == 0x06, "counters reply after unknown bytes %02x", p[0]);
+	packets = (p[5] | p[6] << 8 | p[7] << 16 | (uint32_t)p[8] << 24) -
+		(q[5] | q[6] << 8 | q[7] << 16 | (uint32_t)q[8] << 24);
+	n = (uint16_t)((p[9] | p[10] << 8) - (q[9] | q[10] << 8));
+	CHECK(packets == 2 && n == 3, "counted %u packets %u resyncs, sent 2 and 3 unknown bytes", packets, n);
+
+	// the keys go idle on the way, so the last whole second ticks at
+	// the idle compare
+	scans = 1000000 / sim_timer0_period_us();
+	for(n=0;n<2*scans+2;n++) sim_tick();
+	scans = 1000000 / sim_timer0_period_us();
+	send(get, 1);
+	CHECK(reply(q, 28) == 28, "third counters reply");
+	n = q[20] | q[21] << 8;
+	CHECK(n + 1 >= scans && n <= scans + 1, "scan rate %u, %u a second", n, scans);
+	n = q[22] | q[23] << 8 | q[24] << 16 | (uint32_t)q[25] << 24;
+	CHECK(n >= scans, "loop rate %u", n);
+	CHECK(q[18] | q[19] << 8, "no display refreshes");
+
+	// tilt: readings past the four packets aux_buffer holds are dropped
+	// while the main loop is away, and the reply counts them
+	if(&aux_dropped) {
+		bytes = ADCW;
+		for(n=0;n<16;n++) {
+			ADCW = n & 2 ? 1000 : 24;
+			TIMER1_COMPA_vect();
+		}
+		send(get, 1);
+		reply(0, sim.tx_count - sim.tx_read - 28);	// the four tilt packets kept
+		CHECK(reply(q, 28) == 28 && q[0] == 0x06 && aux_dropped && (q[26] | q[27] << 8) == aux_dropped,
+			"aux drops %u, %u counted", q[26] | q[27] << 8, aux_dropped);
+
+		// settle the filter again and drop what it sends on the way
+		ADCW = bytes;
+		for(n=0;n<64;n++) TIMER1_COMPA_vect();
+		for(n=0;n<8;n++) sim_tick();
+		reply(0, sim.tx_count - sim.tx_read);
+	}
+	else CHECK((q[26] | q[27] << 8) == 0, "aux drops %u without tilt", q[26] | q[27] << 8);
+}
+
+// _SYS_GET_SCHEDULE: a scan every tick misses no key deadline, ticks
+// the main loop never saw do, and each report restarts the maxima
+static void check_schedule(void)
+{
+	static const uint8_t get[] = { 0x0a };
+	uint8_t p[51], q[51];
+	uint16_t misses;
+	uint32_t n;
+
+	send(get, 1);
+	CHECK(reply(p, 51) == 51 && p[0] == 0x07, "schedule reply %02x", p[0]);
+	misses = p[7] | p[8] << 8;
+	for(n=0;n<64;n++) sim_tick();
+	send(get, 1);
+	CHECK(reply(q, 51) == 51 && q[0] == 0x07, "second schedule reply %02x", q[0]);
+	CHECK((q[7] | q[8] << 8) == misses, "%u key misses in 64 ticks", (q[7] | q[8] << 8) - misses);
+	CHECK((q[3] | q[4] << 8) <= q[2], "key wait %u over its deadline %u", q[3] | q[4] << 8, q[2]);
+
+	TIMER0_COMP_vect();
+	TIMER0_COMP_vect();
+	sim_tick();
+	send(get, 1);
+	CHECK(reply(p, 51) == 51, "third schedule reply");
+	CHECK((p[7] | p[8] << 8) == misses + 1, "skipped ticks %u key misses", (p[7] | p[8] << 8) - misses);
+	CHECK((p[3] | p[4] << 8) > p[2], "skipped ticks key wait %u", p[3] | p[4] << 8);
+
+	send(get, 1);
+	CHECK(reply(q, 51) == 51 && (q[3] | q[4] << 8) <= q[2], "key wait %u after a report", q[3] | q[4] << 8);
+}
+
+// a full output queue and a whole display go out over several passes,
+// each stopping about at its slice
+extern uint16_t phase_run[];
+extern uint8_t display_dirty;
+
+static void check_slices(void)
+{
+	static const uint8_t get[] = { 0x0a };
+	uint8_t p[51], i;
+	uint32_t passes;
+
+	send(get, 1);					// restarts the maxima
+	reply(p, 51);
+
+	// 7 id replies, 231 bytes
+	for(i=0;i<7;i++) sim_usb_feed((const uint8_t []) { 0x01 }, 1);
+	sim_drain();
+	CHECK(reply(0, 7 * 33) == 7 * 33, "id replies");
+	CHECK(phase_run[4] <= p[41] + 1, "output ran %u of its %u slice", phase_run[4], p[41]);
+
+	// every row of every chain changes, map after map
+	for(passes=0;passes<8;passes++) {
+		p[0] = 0x14; p[1] = (passes & 1) * 8; p[2] = (passes & 2) * 4;
+		for(i=0;i<8;i++) p[3+i] = passes & 4 ? 0x55 ^ i : 0xaa ^ i;
+		sim_usb_feed(p, 11);
+	}
+	sim_drain();
+	CHECK(!display_dirty && phase_run[2] <= p[21] + 1, "refresh ran %u of its %u slice", phase_run[2], p[21]);
+	send((const uint8_t []) { 0x12 }, 1);
+}
+
+// the scan rate policy: the idle compare once no key has been busy for
+// the hold, the fast one from the first scan that sees a press, then the
+// same with a policy set by _SYS_SET_SCAN, its shortest hold and a 0
+// compare. rate changes miss no ticks
+// RX_TIMEOUT firmwares: a partial packet waits RX_TIMEOUT of key clock,
+// however many main loop passes run meanwhile
+extern volatile uint16_t key_clock;
+extern uint32_t rx_packets;
+extern uint16_t rx_timeouts;
+
+static void check_rx_timeout(void)
+{
+	uint32_t packets;
+	uint16_t t, n, tick;
+
+	if(!RX_TIMEOUT) return;
+
+	// 200 passes without a timer0 tick, a quarter of a tick at most
+	packets = rx_packets;
+	n = rx_timeouts;
+	send((const uint8_t []) { 0x10 }, 1);
+	for(t=0;t<200;t++) sim_loop();
+	send((const uint8_t []) { 0, 0 }, 2);
+	CHECK(rx_packets - packets == 1 && rx_timeouts == n, "packet across 200 quick passes: %u packets %u timeouts",
+		rx_packets - packets, rx_timeouts - n);
+
+	// the key clock past RX_TIMEOUT drops the first byte, the next packet
+	// is read from its own first byte
+	send((const uint8_t []) { 0x10 }, 1);
+	for(t=key_clock;rx_timeouts == n && (uint16_t)(key_clock - t) < 4 * RX_TIMEOUT;) sim_tick();
+	t = key_clock - t;
+	tick = sim_timer0_period_us() / 16;
+	CHECK(rx_timeouts == n + 1 && t + tick > RX_TIMEOUT && t <= RX_TIMEOUT + 2 * tick,
+		"%u timeouts after %u of %u key clock", rx_timeouts - n, t, RX_TIMEOUT);
+	send((const uint8_t []) { 0x13 }, 1);
+	CHECK(rx_packets - packets == 2, "packet after a timeout: %u packets", rx_packets - packets - 1);
+	send((const uint8_t []) { 0x12 }, 1);
+}
+
+static void check_scan(void)
+{
+	static const uint8_t get[] = { 0x0a };
+	static const uint8_t boot[] = { 0x0d, KEY_REFRESH_RATE, KEY_IDLE_RATE, KEY_HOLD & 0xff, KEY_HOLD >> 8 };
+	static const uint8_t set[] = { 0x0d, KEY_REFRESH_RATE, 99, 20, 0 };
+	static const uint8_t shortest[] = { 0x0d, KEY_REFRESH_RATE, 99, 0, 0 };
+	static const uint8_t zero[] = { 0x0d, 0, 0, 0, 0 };
+	uint8_t p[51];
+	uint16_t misses, period, sampled, sent;
+	uint32_t n, m;
+
+	send(get, 1);
+	CHECK(reply(p, 51) == 51, "schedule reply");
+	misses = p[7] | p[8] << 8;
+
+	for(n=0;n<KEY_HOLD+2 && OCR0A != KEY_IDLE_RATE;n++) sim_tick();
+	CHECK(OCR0A == KEY_IDLE_RATE, "compare %u after %u idle scans, idle %u", OCR0A, n, KEY_IDLE_RATE);
+
+	sim_key(0, 5, 2, 1);
+	CHECK(wait_event(p, 16) && p[0] == 0x21, "press while idle");
+	sim_tick();
+	CHECK(OCR0A == KEY_REFRESH_RATE, "compare %u with a key down", OCR0A);
+
+	sim_key(0, 5, 2, 0);
+	CHECK(wait_event(p, 8 * (kButtonUpDefaultDebounceCount + 2)) && p[0] == 0x20, "release");
+	for(n=0;n<KEY_HOLD-16 && OCR0A == KEY_REFRESH_RATE;n++) sim_tick();
+	CHECK(n == KEY_HOLD-16, "compare %u %u scans after a release, hold %u", OCR0A, n, KEY_HOLD);
+	for(m=0;m<18 && OCR0A != KEY_IDLE_RATE;m++) sim_tick();
+	CHECK(OCR0A == KEY_IDLE_RATE, "compare %u %u scans after a release", OCR0A, n + m);
+
+	send(set, sizeof(set));
+	for(n=0;n<22 && OCR0A != 99;n++) sim_tick();
+	CHECK(OCR0A == 99, "compare %u after %u scans, set 99 after 20", OCR0A, n);
+	sim_key(0, 5, 2, 1);
+	CHECK(wait_event(p, 16) && p[0] == 0x21, "press at the set idle rate");
+	sim_tick();
+	CHECK(OCR0A == KEY_REFRESH_RATE, "compare %u with a key down, set policy", OCR0A);
+	sim_key(0, 5, 2, 0);
+	wait_event(p, 8 * (kButtonUpDefaultDebounceCount + 2));
+
+	// the shortest hold still debounces a release at fast, all of it:
+	// its stamp goes back the debounce count of fast ticks
+	send(shortest, sizeof(shortest));
+	send((const uint8_t []) { 0x0e, 2 }, 2);
+	sim_key(0, 5, 2, 1);
+	CHECK(wait_packet(p, 7, 16 * 8) && p[0] == 0x25, "stamped press, shortest hold");
+	period = sim_timer0_period_us() / 16;
+	sim_key(0, 5, 2, 0);
+	for(n=1,m=0;n<=8 * (kButtonUpDefaultDebounceCount + 2) && sim.tx_count - sim.tx_read < 7;n++) {
+		m |= OCR0A != KEY_REFRESH_RATE;
+		sim_tick();
+	}
+	CHECK(reply(p, 7) == 7 && p[0] == 0x24, "stamped release, shortest hold");
+	CHECK(!m, "compare left fast while a release debounced");
+	sampled = p[3] | p[4] << 8;
+	sent = p[5] | p[6] << 8;
+	CHECK((uint16_t)(sent - sampled) / period == kButtonUpDefaultDebounceCount * 8,
+		"stamped release %u ticks after its edge, shortest hold", (uint16_t)(sent - sampled) / period);
+	send((const uint8_t []) { 0x0e, 0 }, 2);
+
+	// a compare of 0 is taken as 1
+	send(zero, sizeof(zero));
+	sim_tick();
+	sim_tick();
+	CHECK(OCR0A == 1, "compare %u set to 0", OCR0A);
+
+	send(boot, sizeof(boot));
+	for(n=0;n<16;n++) sim_tick();
+
+	send(get, 1);
+	CHECK(reply(p, 51) == 51 && (p[7] | p[8] << 8) == misses, "%u key misses changing rates",
+		(uint16_t)((p[7] | p[8] << 8) - misses));
+}
+
+
+// a full grid press while the host stalls, with the aux interrupt
+// firing in between: what arrives must still parse as whole packets
+static void check_output(void)
+{
+	static uint8_t b[SIM_USB_BUFFER];
+	uint8_t c, r, k;
+	uint32_t n, i, len;
+
+	for(c=0;c<chains;c++)
+		for(r=0;r<8;r++)
+			for(k=0;k<8;k++) sim_key(c, r, k, 1);
+
+	for(n=0;n<64;n++) {
+		ADCW = 512 + (n * 37) % 200;
+		TIMER1_COMPA_vect();
+		sim_tick();
+	}
+
+	for(c=0;c<chains;c++)
+		for(r=0;r<8;r++)
+			for(k=0;k<8;k++) sim_key(c, r, k, 0);
+
+	len = 0;
+	for(n=0;n<8*(kButtonUpDefaultDebounceCount+2)*4;n++) {
+		sim_tick();
+		len += reply(b + len, sizeof(b) - len);
+	}
+
+	for(i=0;i<len;) {
+		if(b[i] == 0x20 || b[i] == 0x21 || b[i] == 0x50) i += 3;
+		else if(b[i] == 0x81) i += 8;
+		else break;
+	}
+	CHECK(i == len, "torn output at byte %u of %u (0x%02x)", i, len, i < len ? b[i] : 0);
+	CHECK(sim.tx_dropped == 0, "written while TXE high %u", sim.tx_dropped);
+}
+
+
+// ===============================================================
+int main(int argc, char **argv)
+{
+	variant = argc > 1 ? argv[1] : "mk";
+
+	sim_boot();
+	check_boot();
+	check_sys();
+	check_leds();
+	check_map();
+	check_lines();
+	check_varibright();
+	check_keys();
+	check_debounce();
+	check_key_rows();
+	check_key_stamps();
+	check_rx_timeout();
+	check_counters();
+	check_schedule();
+	check_slices();
+	check_scan();
+	check_output();
+
+	CHECK(sim.tx_dropped == 0, "usb tx dropped %u", sim.tx_dropped);
+
+	printf("%-14s %d checks, %d failed\n", variant, checks, failures);
+	return failures != 0;
+}
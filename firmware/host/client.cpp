@@ -0,0 +1,326 @@
+/************************************************************************
+host checks of the client library (../../client)
+*************************************************************************
+encodes with mk::writer into one firmware variant on the simulated
+board and decodes what it sends back with mk::reader.
+
+usage: client <variant>
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../client/mk.h"
+
+extern "C" {
+#include "port.h"
+#include "button.h"
+
+extern const uint8_t packet_length[];
+}
+
+static const char *variant;
+static int checks, failures;
+
+static uint8_t size_x, size_y;
+
+#define CHECK(cond, ...) do { \
+	checks++; \
+	if(!(cond)) { \
+		failures++; \
+		printf("%s: %s:%d: ", variant, __FILE__, __LINE__); \
+		printf(__VA_ARGS__); \
+		printf("\n"); \
+	} \
+} while(0)
+
+
+// helpers
+// ===============================================================
+static uint8_t buf[4096];
+
+static void send(mk::writer &w)
+{
+	sim_usb_feed(w.data(), w.size());
+	sim_drain();
+	w.clear();
+}
+
+static uint32_t lit(void)
+{
+	uint32_t n = 0;
+	uint8_t q, d, v;
+
+	for(q=0;q<4;q++)
+		for(d=1;d<9;d++)
+			for(v=sim.led_reg[q][d];v;v>>=1) n += v & 1;
+	return n;
+}
+
+// the digits every chain shows now, leaving out the control registers
+// (varibright moves the intensity on every bam slot)
+static bool digits_match(uint8_t want[4][16])
+{
+	uint8_t q;
+
+	for(q=0;q<4;q++)
+		if(memcmp(want[q] + 1, sim.led_reg[q] + 1, 8)) return false;
+	return true;
+}
+
+// everything decoded, in order
+class events : public mk::handler {
+public:
+	events(void) { clear(); }
+	void clear(void) { keys = downs = encoders = tilts = unknowns = 0; name[0] = 0; gx = gy = 0; cn = sn = 0; }
+
+	void key(uint8_t x, uint8_t y, bool down) {
+		if(keys < 256) { kx[keys] = x; ky[keys] = y; kd[keys] = down; }
+		keys++;
+		downs += down;
+	}
+	void encoder(uint8_t n, int8_t delta) { en = n; ed = delta; encoders++; }
+	void tilt(uint8_t n, int16_t x, int16_t y) { tn = n; tx = x; ty = y; tilts++; }
+	void id(const char *s) { snprintf(name, sizeof(name), "%s", s); }
+	void grid_size(uint8_t x, uint8_t y) { gx = x; gy = y; }
+	void counters(const mk::counters &c) { cs = c; cn++; }
+	void schedule(const mk::phase p[mk::phases]) { memcpy(ph, p, sizeof(ph)); sn++; }
+	void unknown(uint8_t b) { unknowns++; }
+
+	uint32_t keys, downs, encoders, tilts, unknowns;
+	uint8_t kx[256], ky[256], kd[256];
+	uint8_t en, tn, gx, gy;
+	int8_t ed;
+	int16_t tx, ty;
+	char name[33];
+	mk::counters cs;
+	mk::phase ph[mk::phases];
+	uint32_t cn, sn;
+};
+
+// whatever the firmware sent, fed to the reader a few bytes at a time
+static void take(mk::reader &r, events &e)
+{
+	uint8_t b[5];
+	uint32_t n;
+
+	while((n = sim_usb_take(b, sizeof(b)))) r.parse(b, n, e);
+}
+
+
+// checks
+// ===============================================================
+// every type the firmware knows must have the library's length
+static void check_lengths(void)
+{
+	uint16_t t;
+
+	for(t=0;t<PACKET_TYPES;t++)
+		if(packet_length[t])
+			CHECK(mk::packet_length[t] == packet_length[t], "type %02x length %d, firmware %d",
+				t, mk::packet_length[t], packet_length[t]);
+}
+
+static void check_encode(void)
+{
+	mk::writer w(buf, sizeof(buf));
+	mk::writer small(buf, 10);
+	mk::reader r;
+	events e;
+	uint8_t rows[8], levels[64], x, y, i;
+
+	// byte for byte
+	w.set(3, 4, 1);
+	w.all(0);
+	w.row(8, 2, 0xa5);
+	w.intensity(7);
+	CHECK(w.size() == 10 && !memcmp(w.data(), "\x11\x03\x04\x12\x15\x08\x02\xa5\x17\x07", 10), "encoding");
+	w.clear();
+
+	for(i=0;i<64;i++) levels[i] = i & 15;
+	w.map_level(0, 8, levels);
+	CHECK(w.size() == 35 && w.data()[0] == 0x1a && w.data()[3] == 0x01 && w.data()[10] == 0xef, "level map");
+	w.clear();
+
+	// whole packets or nothing
+	CHECK(small.set(0, 0, 1) && small.set(0, 0, 1) && small.set(0, 0, 1), "small fills");
+	CHECK(!small.set(0, 0, 1) && small.size() == 9, "small refuses a torn packet");
+	CHECK(small.all(1) && small.size() == 10, "small takes what fits");
+
+	// one batch lights what it says
+	w.all(0);
+	for(x=0;x<size_x;x++)
+		for(y=0;y<size_y;y++)
+			if((x + y) % 3 == 0) w.set(x, y, 1);
+	send(w);
+	for(i=0,x=0;x<size_x;x++)
+		for(y=0;y<size_y;y++) i += (x + y) % 3 == 0;
+	CHECK(lit() == i, "batched sets lit %u of %u", lit(), i);
+
+	for(i=0;i<8;i++) rows[i] = 0xff;
+	w.all(0);
+	w.map(0, 0, rows);
+	w.col(2, 0, 0);
+	send(w);
+	CHECK(lit() == 56, "map and col lit %u", lit());
+
+	w.all(0);
+	w.query_id();
+	w.grid_size();
+	w.counters();
+	w.schedule();
+	send(w);
+	take(r, e);
+	CHECK(!strcmp(e.name, "mk"), "id '%s'", e.name);
+	CHECK(e.gx == size_x && e.gy == size_y, "grid size %dx%d", e.gx, e.gy);
+	CHECK(e.cn == 1 && e.cs.rx_packets >= 4 && e.cs.rx_bytes >= e.cs.rx_packets &&
+		e.cs.display_refreshes, "counters %u packets %u bytes", e.cs.rx_packets, e.cs.rx_bytes);
+	CHECK(e.sn == 1 && e.ph[0].deadline && e.ph[0].slice, "schedule %u, keys deadline %u slice %u",
+		e.sn, e.ph[0].deadline, e.ph[0].slice);
+	CHECK(!e.unknowns, "%u unknown bytes", e.unknowns);
+}
+
+// packets the sim cannot make, split at every byte
+static void check_decode(void)
+{
+	static const uint8_t in[] = {
+		0x50, 3, 0xfe,
+		0x81, 1, 0x34, 0x12, 0xff, 0xff, 0, 0,
+		0x77,
+		0x22, 4, 9, 0x81,
+		0x22, 4, 9, 0x80,
+		0x23, 2, 8, 0x03,
+		0x21, 15, 15
+	};
+	mk::reader r;
+	events e;
+	uint32_t i;
+
+	for(i=0;i<sizeof(in);i++) r.parse(in + i, 1, e);
+
+	CHECK(e.encoders == 1 && e.en == 3 && e.ed == -2, "encoder %d %d", e.en, e.ed);
+	CHECK(e.tilts == 1 && e.tn == 1 && e.tx == 0x1234 && e.ty == -1, "tilt %d %d %d", e.tn, e.tx, e.ty);
+	CHECK(e.unknowns == 1, "unknown bytes %u", e.unknowns);
+
+	// row: 4,9 and 11,9 down, then 4,9 up. col: 2,8 and 2,9 down. key 15,15
+	CHECK(e.keys == 6 && e.downs == 5, "row keys %u downs %u", e.keys, e.downs);
+	CHECK(e.kx[0] == 4 && e.ky[0] == 9 && e.kx[1] == 11 && e.ky[1] == 9, "row key order");
+	CHECK(e.kx[2] == 4 && e.ky[2] == 9 && !e.kd[2], "row release");
+	CHECK(e.kx[3] == 2 && e.ky[3] == 8 && e.kx[4] == 2 && e.ky[4] == 9, "col keys");
+}
+
+// frame diffs must leave the leds as full maps of the new frame do
+static void check_frames(void)
+{
+	mk::writer w(buf, sizeof(buf));
+	uint16_t last[16], next[16];
+	uint8_t want[4][16], rows[8], x, y, r;
+	uint32_t i, bytes, naive;
+
+	srand(2);
+	memset(last, 0, sizeof(last));
+	w.all(0);
+	send(w);
+	bytes = naive = 0;
+
+	for(i=0;i<400;i++) {
+		memcpy(next, last, sizeof(next));
+		if(i % 50 == 0) for(y=0;y<16;y++) next[y] = rand();
+		else if(i % 7 == 0) next[rand() % 16] = rand();
+		else if(i % 5 == 0) for(y=0;y<16;y++) next[y] ^= 1 << (rand() % 16);
+		else next[rand() % 16] ^= 1 << (rand() % 16);
+
+		CHECK(w.frame(last, next, size_x, size_y), "frame %u does not fit", i);
+		bytes += w.size();
+		send(w);
+		memcpy(want, sim.led_reg, sizeof(want));
+
+		for(y=0;y<size_y;y+=8) {
+			for(x=0;x<size_x;x+=8) {
+				for(r=0;r<8;r++) rows[r] = next[y + r] >> x;
+				w.map(x, y, rows);
+			}
+		}
+		naive += w.size();
+		send(w);
+		CHECK(digits_match(want), "frame %u differs from its maps", i);
+
+		memcpy(last, next, sizeof(last));
+	}
+	CHECK(bytes < naive / 2, "frames %u bytes, maps %u", bytes, naive);
+
+	// too small a buffer takes nothing
+	mk::writer small(buf, 4);
+	for(y=0;y<16;y++) next[y] = ~last[y];
+	CHECK(!small.frame(last, next, size_x, size_y) && !small.size(), "frame in a small buffer");
+}
+
+// every key through all three key modes: the events must come out the same
+static void check_keys(void)
+{
+	mk::writer w(buf, sizeof(buf));
+	mk::reader r;
+	events plain, rows, stamped;
+	uint8_t c, k, chains, mode;
+	uint32_t n, wait;
+
+	wait = 8 * (kButtonUpDefaultDebounceCount + 2);
+	chains = (size_x / 8) * (size_y / 8);
+
+	for(mode=0;mode<3;mode++) {
+		events &e = mode == 2 ? stamped : mode ? rows : plain;
+
+		w.key_mode(mode);
+		send(w);
+		r.reset();
+
+		for(c=0;c<chains;c++) {
+			for(k=0;k<8;k++) {
+				sim_key(c, k, 7 - k, 1);
+				for(n=0;n<16;n++) sim_tick();
+				take(r, e);
+				sim_key(c, k, 7 - k, 0);
+				for(n=0;n<wait;n++) sim_tick();
+				take(r, e);
+			}
+		}
+	}
+
+	CHECK(plain.keys == chains * 16u && plain.downs == chains * 8u, "key events %u", plain.keys);
+	CHECK(rows.keys == plain.keys, "row mode %u events, key mode %u", rows.keys, plain.keys);
+	CHECK(!memcmp(rows.kx, plain.kx, plain.keys) && !memcmp(rows.ky, plain.ky, plain.keys) &&
+		!memcmp(rows.kd, plain.kd, plain.keys), "row mode events differ");
+	CHECK(stamped.keys == plain.keys && !memcmp(stamped.kx, plain.kx, plain.keys) &&
+		!memcmp(stamped.ky, plain.ky, plain.keys) && !memcmp(stamped.kd, plain.kd, plain.keys),
+		"stamped mode %u events, key mode %u", stamped.keys, plain.keys);
+
+	w.key_mode(0);
+	send(w);
+}
+
+
+// ===============================================================
+int main(int argc, char **argv)
+{
+	mk::writer w(buf, sizeof(buf));
+	mk::reader r;
+	events e;
+
+	variant = argc > 1 ? argv[1] : "mk";
+
+	sim_boot();
+	w.grid_size();
+	send(w);
+	take(r, e);
+	size_x = e.gx;
+	size_y = e.gy;
+
+	check_lengths();
+	check_encode();
+	check_decode();
+	check_frames();
+	check_keys();
+
+	printf("%-14s %d client checks, %d failed\n", variant, checks, failures);
+	return failures != 0;
+}
@@ -0,0 +1,205 @@
+/************************************************************************
+host replay of a recorded serial stream
+*************************************************************************
+feeds a recorded host to device byte stream through one firmware variant
+on the simulated board, as fast as the pc allows, and reports what the
+packet parser made of it.
+
+usage: replay [-c bytes] [-g bytes:us] <variant> <stream>
+
+  stream      raw bytes as the host wrote them, - for stdin
+  -c bytes    most bytes handed to the ft245 per main loop pass (64,
+              one full speed usb packet)
+  -g n:us     the host goes quiet for us microseconds after every n
+              bytes, so packets straddle the gaps the way they straddle
+              usb frames. timer0 keeps ticking through a gap, which is
+              the key clock RX_TIMEOUT is measured on.
+
+after the stream the host stays quiet for 10ms, then turns every led on
+and off twice. a parser still out of step by then gets those wrong and
+the replay exits non zero.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "port.h"
+#include "button.h"
+
+static const char *variant;
+
+extern uint32_t rx_packets;
+extern uint16_t rx_resyncs;
+extern uint8_t rx_count;
+
+// default keeps 4 bit levels in planes, the others one bit per led
+extern uint8_t display[4][8] __attribute__((weak));
+extern uint8_t plane[4][4][8] __attribute__((weak));
+
+static uint32_t packets, resyncs;
+static uint32_t packets_seen;
+static uint16_t resyncs_seen;
+static uint64_t tick_at;		// cycle of the next timer0 compare
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// rx_resyncs wraps at 16 bits, a pass moves it far less. timer0 fires
+// on the clock at whatever rate the scan runs
+static void loop(void)
+{
+	if(sim.cycles >= tick_at) {
+		TIMER0_COMP_vect();
+		tick_at += (uint64_t)sim_timer0_period_us() * 16;
+	}
+	sim_loop();
+	packets += rx_packets - packets_seen;
+	resyncs += (uint16_t)(rx_resyncs - resyncs_seen);
+	packets_seen = rx_packets;
+	resyncs_seen = rx_resyncs;
+}
+
+static void quiet(uint32_t us)
+{
+	uint64_t until = sim.cycles + (uint64_t)us * 16;
+
+	while(sim.cycles < until) loop();
+}
+
+static uint8_t *load(const char *path, uint32_t *len)
+{
+	FILE *f;
+	uint8_t *data = NULL;
+	uint32_t size = 0, n;
+
+	f = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+	if(!f) { perror(path); exit(2); }
+
+	*len = 0;
+	do {
+		if(*len == size) {
+			size = size ? size * 2 : 65536;
+			data = realloc(data, size);
+		}
+		n = fread(data + *len, 1, size - *len, f);
+		*len += n;
+	} while(n);
+
+	if(f != stdin) fclose(f);
+	return data;
+}
+
+static uint32_t lit(void)
+{
+	uint32_t n = 0;
+	uint8_t q, d, v;
+
+	for(q=0;q<4;q++)
+		for(d=1;d<9;d++)
+			for(v=sim.led_reg[q][d];v;v>>=1) n += v & 1;
+	return n;
+}
+
+// quadrants side by side as the firmware holds them: row r, bit 7 first
+static void print_display(void)
+{
+	uint8_t q, r, b, l, i;
+
+	for(r=0;r<8;r++) {
+		printf("  ");
+		for(q=0;q<4;q++) {
+			for(b=8;b--;) {
+				if(plane) {
+					for(l=i=0;i<4;i++) l |= ((plane[i][q][r] >> b) & 1) << i;
+					putchar(l ? "0123456789abcdef"[l] : '.');
+				}
+				else putchar(display[q][r] & (1 << b) ? '#' : '.');
+			}
+			putchar(' ');
+		}
+		putchar('\n');
+	}
+}
+
+
+// ===============================================================
+int main(int argc, char **argv)
+{
+	uint8_t *stream;
+	uint32_t len, pos, chunk, gap_every, gap_us, next_gap, n, i;
+	uint64_t cycles;
+	double t;
+	int arg, synced;
+
+	chunk = 64;
+	gap_every = gap_us = 0;
+
+	for(arg=1;arg<argc && argv[arg][0] == '-' && argv[arg][1];arg++) {
+		if(!strcmp(argv[arg], "-c") && arg + 1 < argc) chunk = atoi(argv[++arg]);
+		else if(!strcmp(argv[arg], "-g") && arg + 1 < argc) {
+			if(sscanf(argv[++arg], "%u:%u", &gap_every, &gap_us) != 2) gap_every = 0;
+		}
+		else break;
+	}
+	if(argc - arg != 2 || !chunk) {
+		fprintf(stderr, "usage: replay [-c bytes] [-g bytes:us] <variant> <stream>\n");
+		return 2;
+	}
+	variant = argv[arg];
+	stream = load(argv[arg+1], &len);
+
+	sim_boot();
+	tick_at = sim.cycles + (uint64_t)sim_timer0_period_us() * 16;
+	packets_seen = rx_packets;
+	resyncs_seen = rx_resyncs;
+	cycles = sim.cycles;
+	t = now();
+
+	next_gap = gap_every ? gap_every : len;
+	for(pos=0;pos<len;) {
+		if(!sim_usb_pending()) {
+			n = chunk;
+			if(n > next_gap - pos) n = next_gap - pos;
+			if(n > len - pos) n = len - pos;
+			pos += sim_usb_feed(stream + pos, n);
+		}
+		loop();
+
+		if(pos == next_gap && gap_every) {
+			while(sim_usb_pending()) loop();
+			quiet(gap_us);
+			next_gap += gap_every;
+		}
+	}
+	while(sim_usb_pending()) loop();
+
+	t = now() - t;
+	cycles = sim.cycles - cycles;
+
+	quiet(10000);
+
+	printf("%-14s replay %u bytes  %u packets  %.0f packets/s host  %.0f packets/s avr  %u resyncs  %s\n",
+		variant, len, packets, packets / t, packets / (cycles / 16e6), resyncs,
+		rx_count ? "ends inside a packet" : "ends between packets");
+	print_display();
+
+	// every led on, off, on, off: an out of step parser swallows the
+	// first and the rest land one packet late
+	synced = 1;
+	for(n=0;n<4;n++) {
+		sim_usb_feed(n & 1 ? (const uint8_t []) { 0x12 } : (const uint8_t []) { 0x13 }, 1);
+		for(i=0;i<64;i++) loop();
+		if(n & 1 ? lit() != 0 : lit() < 64) synced = 0;
+	}
+
+	if(!synced) printf("%-14s parser out of step after the stream\n", variant);
+
+	free(stream);
+	return !synced;
+}
@@ -0,0 +1,379 @@
+/************************************************************************
+host simulation of the mk board, see sim.h
+*/
+
+#include <string.h>
+#include "port.h"
+
+struct sim sim;
+
+volatile uint8_t DDRA, DDRF, PORTA, PORTF, PINA, PINF;
+volatile uint8_t TCCR0A, TIMSK0, OCR0A, TCNT0;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+volatile uint8_t TCCR2A, TIMSK2, OCR2A, TCNT2;
+volatile uint16_t OCR1A, TCNT1;
+volatile uint8_t EECR, EEDR;
+volatile uint16_t EEAR;
+volatile uint8_t ADMUX, ADCSRA;
+volatile uint16_t ADCW;
+
+// variants without an aux port have no timer1 handler
+__attribute__((weak)) void TIMER1_COMPA_vect(void) {}
+__attribute__((weak)) void TIMER2_COMP_vect(void) {}
+
+static void usb_arrive(void);
+
+
+void sim_reset(void)
+{
+	memset(&sim, 0, sizeof(sim));
+
+	DDRA = DDRF = PORTA = PORTF = 0;
+	PINA = PINF = 0xff;				// pulled up, nothing connected
+	TCCR0A = TIMSK0 = OCR0A = TCNT0 = 0;
+	TCCR1A = TCCR1B = TIMSK1 = 0;
+	TCCR2A = TIMSK2 = OCR2A = TCNT2 = 0;
+	OCR1A = TCNT1 = 0;
+	EECR = EEDR = 0;
+	EEAR = 0;
+	ADMUX = ADCSRA = 0;
+	ADCW = 512;						// level
+}
+
+// clock
+// ===============================================================
+static uint32_t timer2_period(void)
+{
+	static const uint16_t prescale[8] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+
+	return ((uint32_t)OCR2A + 1) * prescale[TCCR2A & 0x07];
+}
+
+// ctc: the handler may change OCR1A for the period that starts with it
+static uint32_t timer1_period(void)
+{
+	static const uint16_t prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+
+	if(!(TCCR1B & (1 << WGM12))) return 0;
+	return ((uint32_t)OCR1A + 1) * prescale[TCCR1B & 0x07];
+}
+
+// TCNT0 between the hand fired compares, a handler writing it restarts it
+static void timer0_count(void)
+{
+	static const uint16_t prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+	uint64_t n;
+
+	if(!(TIMSK0 & (1 << OCIE0A)) || !prescale[TCCR0A & 0x07]) return;
+	if(TCNT0 != sim.tcnt0) sim.timer0_zero = sim.cycles - (uint64_t)TCNT0 * prescale[TCCR0A & 0x07];
+	n = (sim.cycles - sim.timer0_zero) / prescale[TCCR0A & 0x07];
+	TCNT0 = sim.tcnt0 = n < OCR0A ? n : OCR0A;
+}
+
+static void sim_advance(uint32_t cycles)
+{
+	sim.cycles += cycles;
+	usb_arrive();
+	timer0_count();
+
+	if(sim.in_isr) return;
+
+	if((TIMSK2 & (1 << OCIE2A)) && timer2_period()) {
+		if(!sim.timer2_next) sim.timer2_next = sim.cycles + timer2_period();
+		while(sim.cycles >= sim.timer2_next) {
+			sim.timer2_next += timer2_period();
+			sim.in_isr = 1;
+			sim.cycles += SIM_ISR_CYCLES;
+			TIMER2_COMP_vect();
+			sim.in_isr = 0;
+		}
+	}
+
+	if((TIMSK1 & (1 << OCIE1A)) && timer1_period()) {
+		if(!sim.timer1_next) sim.timer1_next = sim.cycles + timer1_period();
+		while(sim.cycles >= sim.timer1_next) {
+			sim.in_isr = 1;
+			sim.cycles += SIM_ISR_CYCLES;
+			TIMER1_COMPA_vect();
+			sim.in_isr = 0;
+			sim.timer1_next += timer1_period();
+		}
+	}
+}
+
+void sim_delay_us(uint32_t us)
+{
+	sim.time_us += us;
+	sim_advance(us * 16);
+}
+
+
+// run the firmware
+// ===============================================================
+void sim_boot(void)
+{
+	sim_reset();
+	mk_init();
+
+	// variants with usb sleep handling wake on the first passes
+	sim_loop();
+	sim_loop();
+	sim.time_us = 0;
+	sim.port_writes = 0;
+	sim.led_loads = 0;
+	sim.key_loads = 0;
+}
+
+void sim_loop(void)
+{
+	sim_advance(SIM_LOOP_CYCLES);
+	mk_loop();
+}
+
+// one keypad timer interrupt followed by a main loop pass
+void sim_tick(void)
+{
+	TIMER0_COMP_vect();
+	sim_loop();
+}
+
+// main loop passes until the rx fifo is empty, then enough to work
+// through what the firmware buffered and flush the replies
+void sim_drain(void)
+{
+	uint8_t i;
+
+	while(sim.rx_head != sim.rx_tail) sim_loop();
+	for(i=0;i<8;i++) sim_loop();
+}
+
+
+// ft245
+// ===============================================================
+static uint8_t usb_status(void)
+{
+	uint8_t s = 0;
+
+	if(sim.rx_head == sim.rx_tail) s |= C1_RXF;			// RXF high: fifo empty
+	if(sim.tx_count - sim.tx_read >= SIM_FT245_TX_FIFO) s |= C0_TXE;
+	return s;											// PWREN low: powered
+}
+
+static void usb_fetch(void)
+{
+	uint64_t latency;
+
+	if(sim.rx_head != sim.rx_tail) {
+		latency = sim.cycles - sim.rx_stamp[sim.rx_tail % SIM_USB_BUFFER];
+		sim.rx_latency_sum += latency;
+		if(latency > sim.rx_latency_max) sim.rx_latency_max = latency;
+		sim.rx_fetches++;
+
+		sim.rx_latch = sim.rx[sim.rx_tail % SIM_USB_BUFFER];
+		sim.rx_tail++;
+		sim.rx_fetched = 1;
+	}
+}
+
+static void usb_strobe(uint8_t old, uint8_t new)
+{
+	// RD falling: fifo drives the next byte onto the bus
+	if((old & C3_RD) && !(new & C3_RD)) usb_fetch();
+	if(new & C3_RD) sim.rx_fetched = 0;
+
+	// WR falling: fifo takes the byte on the bus
+	if((old & C2_WR) && !(new & C2_WR)) {
+		if(sim.tx_count - sim.tx_read < SIM_FT245_TX_FIFO) {
+			sim.tx[sim.tx_count % SIM_USB_BUFFER] = sim.reg[SIM_PORTD];
+			sim.tx_count++;
+		}
+		else sim.tx_dropped++;
+	}
+}
+
+uint32_t sim_usb_feed(const uint8_t *data, uint32_t len)
+{
+	uint32_t i;
+
+	for(i=0;i<len && sim.rx_head - sim.rx_tail < SIM_USB_BUFFER;i++) {
+		sim.rx[sim.rx_head % SIM_USB_BUFFER] = data[i];
+		sim.rx_stamp[sim.rx_head % SIM_USB_BUFFER] = sim.cycles;
+		sim.rx_head++;
+	}
+	return i;
+}
+
+// the host sends as fast as the link allows while the fifo has room
+void sim_usb_stream(const uint8_t *data, uint32_t len, uint32_t cycles_per_byte)
+{
+	sim.stream = data;
+	sim.stream_len = len;
+	sim.stream_pos = 0;
+	sim.stream_cycles = cycles_per_byte;
+	sim.stream_next = sim.cycles;
+	sim.stream_stalled = 0;
+}
+
+static void usb_arrive(void)
+{
+	while(sim.stream_pos < sim.stream_len && sim.stream_next <= sim.cycles) {
+		if(sim.rx_head - sim.rx_tail >= SIM_FT245_FIFO) {
+			sim.stream_stalled += sim.cycles - sim.stream_next;
+			sim.stream_next = sim.cycles;
+			return;
+		}
+		sim.rx[sim.rx_head % SIM_USB_BUFFER] = sim.stream[sim.stream_pos++];
+		sim.rx_stamp[sim.rx_head % SIM_USB_BUFFER] = sim.stream_next;
+		sim.rx_head++;
+		sim.stream_next += sim.stream_cycles;
+	}
+}
+
+uint32_t sim_usb_pending(void)
+{
+	return sim.rx_head - sim.rx_tail;
+}
+
+uint32_t sim_usb_take(uint8_t *data, uint32_t max)
+{
+	uint32_t i;
+
+	for(i=0;i<max && sim.tx_read != sim.tx_count;i++) {
+		if(data) data[i] = sim.tx[sim.tx_read % SIM_USB_BUFFER];
+		sim.tx_read++;
+	}
+	return i;
+}
+
+
+// max7219 + 74hc165 on PORTE
+// ===============================================================
+static const uint8_t led_ser[4] = { E5_SER1, E4_SER2, E3_SER3, E2_SER4 };
+
+// a digit's lit time from its last latch up to now, raw and at the
+// driver's intensity (duty (2n+1)/32)
+static void digit_settle(uint8_t i, uint8_t d)
+{
+	uint8_t b;
+	uint64_t t = sim.cycles - sim.led_since[i][d-1];
+
+	for(b=0;b<8;b++)
+		if(sim.led_reg[i][d] & (1 << b)) {
+			sim.led_lit[i][d-1][b] += t;
+			sim.led_glow[i][d-1][b] += t * (2 * (sim.led_reg[i][10] & 0x0f) + 1);
+		}
+	sim.led_since[i][d-1] = sim.cycles;
+}
+
+static void porte_edges(uint8_t old, uint8_t new)
+{
+	uint8_t i, r, d;
+
+	// led clock rising: shift SER1..SER4 into the drivers
+	if(!(old & E0_CLK) && (new & E0_CLK)) {
+		for(i=0;i<4;i++)
+			sim.led_shift[i] = (sim.led_shift[i] << 1) | ((new & led_ser[i]) != 0);
+	}
+
+	// led load rising: drivers latch address/data
+	if(!(old & E1_LD) && (new & E1_LD)) {
+		for(i=0;i<4;i++) {
+			d = (sim.led_shift[i] >> 8) & 0x0f;
+			if(d >= 1 && d <= 8) digit_settle(i, d);
+			if(d == 10)
+				for(r=1;r<9;r++) digit_settle(i, r);
+			sim.led_reg[i][d] = sim.led_shift[i] & 0xff;
+		}
+		sim.led_loads++;
+	}
+
+	// key load rising: registers hold the selected row
+	if(!(old & E7_LD) && (new & E7_LD)) {
+		r = (sim.reg[SIM_PORTB] >> 4) & 0x07;
+		for(i=0;i<4;i++) sim.key_shift[i] = sim.key[i][r];
+		sim.key_loads++;
+	}
+
+	// key clock rising while shifting: next column
+	if(!(old & E6_CLK) && (new & E6_CLK) && (new & E7_LD)) {
+		for(i=0;i<4;i++) sim.key_shift[i] >>= 1;
+	}
+}
+
+// cycles a led has been lit, up to now
+uint64_t sim_led_lit(uint8_t chain, uint8_t digit, uint8_t bit)
+{
+	uint64_t t = sim.led_lit[chain][digit-1][bit];
+
+	if(sim.led_reg[chain][digit] & (1 << bit)) t += sim.cycles - sim.led_since[chain][digit-1];
+	return t;
+}
+
+// the same in 32nds of a cycle at full duty, weighted by the intensity
+// register while lit
+uint64_t sim_led_glow(uint8_t chain, uint8_t digit, uint8_t bit)
+{
+	uint64_t t = sim.led_glow[chain][digit-1][bit];
+
+	if(sim.led_reg[chain][digit] & (1 << bit))
+		t += (sim.cycles - sim.led_since[chain][digit-1]) * (2 * (sim.led_reg[chain][10] & 0x0f) + 1);
+	return t;
+}
+
+static uint8_t key_serial(void)
+{
+	uint8_t s = 0;
+
+	// pressed keys pull the line low
+	if(!(sim.key_shift[0] & 1)) s |= B3_SER1;
+	if(!(sim.key_shift[1] & 1)) s |= B2_SER2;
+	if(!(sim.key_shift[2] & 1)) s |= B1_SER3;
+	if(!(sim.key_shift[3] & 1)) s |= B0_SER4;
+	return s;
+}
+
+void sim_key(uint8_t chain, uint8_t row, uint8_t col, uint8_t down)
+{
+	if(down) sim.key[chain & 3][row & 7] |= 1 << (col & 7);
+	else sim.key[chain & 3][row & 7] &= ~(1 << (col & 7));
+}
+
+
+// registers
+// ===============================================================
+uint8_t sim_read(uint8_t reg)
+{
+	switch(reg) {
+	case SIM_PINB: return key_serial();
+	case SIM_PINC: return usb_status();
+	case SIM_PIND:
+		if(sim.reg[SIM_DDRD]) return sim.reg[SIM_PORTD];
+		// RD already low from reset: the first read still gets a byte
+		if(!(sim.reg[SIM_PORTC] & C3_RD) && !sim.rx_fetched) usb_fetch();
+		return sim.rx_latch;
+	default: return sim.reg[reg];
+	}
+}
+
+void sim_write(uint8_t reg, uint8_t v)
+{
+	uint8_t old = sim.reg[reg];
+
+	sim.port_writes++;
+	sim.reg[reg] = v;
+
+	if(reg == SIM_PORTE) porte_edges(old, v);
+	else if(reg == SIM_PORTC) usb_strobe(old, v);
+
+	sim_advance(SIM_WRITE_CYCLES);
+}
+
+
+// timer0 compare period of the tick now running, the scan rate can change it
+// ===============================================================
+uint32_t sim_timer0_period_us(void)
+{
+	static const uint16_t prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+
+	return ((uint32_t)OCR0A + 1) * prescale[TCCR0A & 0x07] / 16;
+}
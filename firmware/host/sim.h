@@ -0,0 +1,166 @@
+/************************************************************************
+host simulation of the mk board
+*************************************************************************
+pin level models of the parts mk.c talks to:
+
+  FT245    - rx fifo fed by the host program, tx capture buffer.
+             RXF/TXE on PINC, RD/WR strobes on PORTC, data on PORTD/PIND.
+  MAX7219  - one per quadrant, SER1..SER4 on PORTE shifted by E0_CLK,
+             latched on the rising edge of E1_LD.
+  74HC165  - keypad shift registers, loaded while E7_LD is low from the
+             row selected on PORTB, shifted by E6_CLK, read on PINB.
+
+registers that no model cares about (timers, adc, eeprom, aux ports) are
+plain variables so the firmware init code compiles unchanged.
+
+time is a rough cpu clock in cycles: every PORT_* write costs
+SIM_WRITE_CYCLES, delays cost what they ask for and each main loop pass
+SIM_LOOP_CYCLES. pure computation is not counted. the clock drives host
+stream arrival, the timer2 (usb rx) interrupt and timer1 when it runs
+in ctc mode (bam). timer0 is ticked by hand with sim_tick(), as is
+timer1 in the aux variants that run it free; TCNT0 still counts the
+clock between ticks, up to OCR0A.
+*/
+
+#ifndef __SIM_H__
+#define __SIM_H__
+
+#include <inttypes.h>
+
+// registers routed through PORT_* in port.h
+enum {
+	SIM_PORTB, SIM_DDRB, SIM_PINB,
+	SIM_PORTC, SIM_DDRC, SIM_PINC,
+	SIM_PORTD, SIM_DDRD, SIM_PIND,
+	SIM_PORTE, SIM_DDRE,
+	SIM_REGS
+};
+
+uint8_t sim_read(uint8_t reg);
+void sim_write(uint8_t reg, uint8_t v);
+
+// everything else
+extern volatile uint8_t DDRA, DDRF, PORTA, PORTF, PINA, PINF;
+extern volatile uint8_t TCCR0A, TIMSK0, OCR0A, TCNT0;
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+extern volatile uint8_t TCCR2A, TIMSK2, OCR2A, TCNT2;
+extern volatile uint16_t OCR1A, TCNT1;
+extern volatile uint8_t EECR, EEDR;
+extern volatile uint16_t EEAR;
+extern volatile uint8_t ADMUX, ADCSRA;
+extern volatile uint16_t ADCW;
+
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define OCIE0A 1
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define OCIE1A 1
+#define WGM12 3
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define WGM21 3
+#define OCIE2A 1
+#define EERE 0
+#define EEWE 1
+#define MUX0 0
+#define ADSC 6
+#define ADEN 7
+#define ADPS2 2
+
+#define ISR(vector) void vector(void)
+#define sei()
+#define cli()
+#define _delay_us(us) sim_delay_us(us)
+#define _delay_ms(ms) sim_delay_us((ms) * 1000UL)
+
+void TIMER0_COMP_vect(void);
+void TIMER1_COMPA_vect(void);
+void TIMER2_COMP_vect(void);
+
+// firmware entry points (mk.c)
+void mk_init(void);
+void mk_loop(void);
+
+
+#ifndef SIM_USB_BUFFER
+#define SIM_USB_BUFFER 65536		// power of two, vgrid keeps one per device
+#endif
+#define SIM_FT245_FIFO 128			// receive fifo of the real part
+#define SIM_FT245_TX_FIFO 384		// and its transmit fifo, TXE high when full
+
+#define SIM_WRITE_CYCLES 2
+#define SIM_LOOP_CYCLES 32
+#define SIM_ISR_CYCLES 24			// entry, register saves, reti
+
+struct sim {
+	uint8_t reg[SIM_REGS];
+	uint32_t time_us;			// advanced by _delay_*
+	uint32_t port_writes;		// PORT_* writes, a rough cost measure
+	uint64_t cycles;			// rough cpu clock, see above
+	uint64_t timer1_next;		// cycle of the next timer1 compare (ctc only)
+	uint64_t timer2_next;		// cycle of the next timer2 compare
+	uint64_t timer0_zero;		// cycle TCNT0 was last 0
+	uint8_t tcnt0;				// what the sim last put in TCNT0
+	uint8_t in_isr;
+
+	// ft245
+	uint8_t rx[SIM_USB_BUFFER];
+	uint32_t rx_head, rx_tail;
+	uint8_t rx_latch;
+	uint8_t rx_fetched;			// byte taken during this RD strobe
+	uint64_t rx_stamp[SIM_USB_BUFFER];	// cycle each byte entered the fifo
+	uint64_t rx_latency_sum;	// cycles from fifo entry to RD
+	uint64_t rx_latency_max;
+	uint32_t rx_fetches;
+
+	// host stream, sent no faster than one byte per stream_cycles
+	const uint8_t *stream;
+	uint32_t stream_len, stream_pos, stream_cycles;
+	uint64_t stream_next;		// cycle the next byte may be sent
+	uint64_t stream_stalled;	// cycles the host waited on a full fifo
+	uint8_t tx[SIM_USB_BUFFER];
+	uint32_t tx_count;			// bytes written by the firmware
+	uint32_t tx_read;			// bytes taken by sim_usb_take()
+	uint32_t tx_dropped;		// written while TXE was high
+
+	// max7219, one per quadrant
+	uint16_t led_shift[4];
+	uint8_t led_reg[4][16];
+	uint32_t led_loads;
+	uint64_t led_lit[4][8][8];	// [chain][digit-1][bit] cycles lit, see sim_led_lit()
+	uint64_t led_glow[4][8][8];	// the same at the intensity register, see sim_led_glow()
+	uint64_t led_since[4][8];	// cycle each digit was last latched
+
+	// 74hc165 keypad chains
+	uint8_t key[4][8];			// [chain][row select], bit = column, 1 = pressed
+	uint8_t key_shift[4];
+	uint32_t key_loads;
+};
+
+extern struct sim sim;
+
+void sim_reset(void);
+void sim_delay_us(uint32_t us);
+
+void sim_boot(void);
+void sim_loop(void);
+void sim_tick(void);
+void sim_drain(void);
+
+uint32_t sim_usb_feed(const uint8_t *data, uint32_t len);
+uint32_t sim_usb_pending(void);
+void sim_usb_stream(const uint8_t *data, uint32_t len, uint32_t cycles_per_byte);
+uint32_t sim_usb_take(uint8_t *data, uint32_t max);
+
+uint64_t sim_led_lit(uint8_t chain, uint8_t digit, uint8_t bit);
+uint64_t sim_led_glow(uint8_t chain, uint8_t digit, uint8_t bit);
+
+void sim_key(uint8_t chain, uint8_t row, uint8_t col, uint8_t down);
+
+uint32_t sim_timer0_period_us(void);
+
+#endif
@@ -0,0 +1,449 @@
+/************************************************************************
+virtual mk devices on pseudo terminals
+*************************************************************************
+runs one firmware variant on the simulated board behind a pty per device,
+so host software opens /dev/pts/<n> as it would a grid's ft245 port.
+the firmware answers everything itself, _SYS_QUERY, _SYS_QUERY_ID and
+_SYS_GET_GRID_SIZE included.
+
+usage: vgrid [-n devices] [-l dir] <variant>
+
+  -n devices  how many (1)
+  -l dir      also links dir/mk0, dir/mk1 .. to the ptys
+
+prints "mk<n> <pty>" per device once all are up, then reads commands
+from stdin, one per line:
+
+  key <dev> <x> <y> <0|1>   press or release a key, dev * for all
+  sleep <ms>                hold the commands that follow
+  quit
+
+every device is a copy of all the firmware and sim variables, linked
+into one section by vgrid.ld. a single epoll loop copies the device
+with work into that section and runs it: main loop passes as fast as
+the pc allows while it has bytes to read or send, timer0 ticks in real
+time for the debounce time after a key change. idle devices cost
+memory, no cpu.
+
+replies nobody reads wait in the pty, then in the ft245 fifo with TXE
+high, as on a grid whose host stopped reading.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include "port.h"
+#include "button.h"
+
+extern uint8_t __start_vgrid_state[], __stop_vgrid_state[];
+
+#define STATE_SIZE ((size_t)(__stop_vgrid_state - __start_vgrid_state))
+#define OUT_SIZE 512				// replies on their way to the pty
+#define TICK_US 1000				// timer0 catch up period
+#define DEVICE (1ULL << 32)			// epoll data of device n: DEVICE | n, others the fd
+
+struct device {
+	uint8_t *state;
+	int master, slave;
+	uint8_t out[OUT_SIZE];
+	uint32_t out_len;
+	uint32_t busy_us;				// real time left to tick timer0
+	uint32_t tick_us;				// part of a timer0 period owed
+	uint8_t polling_out;
+	char link[256];
+};
+
+static const char *variant;
+static struct device *devices, *current;
+static uint32_t count;
+static int epfd, ticker, sleeper;
+
+static uint8_t *fresh, *booted;		// variables as loaded, and after sim_boot
+static uint32_t debounce_us;
+
+// where each key is wired: the firmware's own report of it
+static struct { uint8_t chain, row, col, wired; } keys[16][16];
+static uint8_t size_x, size_y;
+
+static char commands[4096];
+static uint32_t commands_len;
+static uint8_t input = 1, input_file;	// stdin still open, and a plain file
+static uint8_t listening;				// stdin in the epoll set
+static uint8_t holding, quitting;
+
+
+// devices
+// ===============================================================
+static void use(struct device *d)
+{
+	if(d == current) return;
+	if(current) memcpy(current->state, __start_vgrid_state, STATE_SIZE);
+	memcpy(__start_vgrid_state, d->state, STATE_SIZE);
+	current = d;
+}
+
+static void poll_out(struct device *d, uint8_t on)
+{
+	struct epoll_event e;
+
+	if(d->polling_out == on) return;
+	e.events = EPOLLIN | (on ? EPOLLOUT : 0);
+	e.data.u64 = DEVICE | (d - devices);
+	epoll_ctl(epfd, EPOLL_CTL_MOD, d->master, &e);
+	d->polling_out = on;
+}
+
+// moves what the firmware wrote towards the pty, d in place
+static void collect(struct device *d, uint8_t flush)
+{
+	ssize_t n;
+
+	for(;;) {
+		d->out_len += sim_usb_take(d->out + d->out_len, OUT_SIZE - d->out_len);
+		if(!d->out_len || (!flush && d->out_len < OUT_SIZE)) break;
+
+		n = write(d->master, d->out, d->out_len);
+		if(n <= 0) break;
+		memmove(d->out, d->out + n, d->out_len - n);
+		d->out_len -= n;
+	}
+	if(flush) poll_out(d, d->out_len != 0);
+}
+
+// main loop passes until the rx fifo is empty and the replies are out
+static void run(struct device *d)
+{
+	uint8_t i;
+
+	use(d);
+	while(sim_usb_pending()) {
+		sim_loop();
+		collect(d, 0);
+	}
+	for(i=0;i<8;i++) {
+		sim_loop();
+		collect(d, 0);
+	}
+	collect(d, 1);
+}
+
+static void receive(struct device *d)
+{
+	static uint8_t b[SIM_USB_BUFFER];
+	ssize_t n;
+
+	use(d);
+	n = read(d->master, b, SIM_USB_BUFFER - sim_usb_pending());
+	if(n > 0) sim_usb_feed(b, n);
+	run(d);
+}
+
+static void tick(struct device *d, uint32_t us)
+{
+	uint32_t p;
+
+	use(d);
+	// the period follows the firmware's scan rate
+	for(d->tick_us+=us;d->tick_us>=(p = sim_timer0_period_us());d->tick_us-=p) {
+		sim_tick();
+		collect(d, 0);
+	}
+	collect(d, 1);
+	d->busy_us = d->busy_us > us ? d->busy_us - us : 0;
+}
+
+static void ticking(uint8_t on)
+{
+	struct itimerspec t;
+
+	memset(&t, 0, sizeof(t));
+	if(on) t.it_value.tv_nsec = t.it_interval.tv_nsec = TICK_US * 1000;
+	timerfd_settime(ticker, 0, &t, NULL);
+}
+
+static void key(struct device *d, uint8_t x, uint8_t y, uint8_t down)
+{
+	use(d);
+	sim_key(keys[x][y].chain, keys[x][y].row, keys[x][y].col, down);
+	if(!d->busy_us) d->tick_us = 0;
+	d->busy_us = debounce_us;
+	ticking(1);
+}
+
+
+// setup
+// ===============================================================
+// every key pressed once on a scratch board
+static void learn_keys(void)
+{
+	static const uint8_t q[1] = { 0x05 };
+	uint8_t c, r, k, ev[64];
+	uint32_t n, i;
+
+	memcpy(__start_vgrid_state, fresh, STATE_SIZE);
+	sim_boot();
+	sim_usb_feed(q, 1);
+	sim_drain();
+	if(sim_usb_take(ev, 3) == 3 && ev[0] == 0x03) {
+		size_x = ev[1];
+		size_y = ev[2];
+	}
+
+	for(c=0;c<(size_x / 8) * (size_y / 8);c++) {
+		for(r=0;r<8;r++) {
+			for(k=0;k<8;k++) {
+				sim_key(c, r, k, 1);
+				for(i=0;i<16;i++) sim_tick();
+				n = sim_usb_take(ev, sizeof(ev));
+				if(n >= 3 && ev[0] == 0x21 && ev[1] < 16 && ev[2] < 16) {
+					keys[ev[1]][ev[2]].chain = c;
+					keys[ev[1]][ev[2]].row = r;
+					keys[ev[1]][ev[2]].col = k;
+					keys[ev[1]][ev[2]].wired = 1;
+				}
+				sim_key(c, r, k, 0);
+				for(i=0;i<8 * (kButtonUpDefaultDebounceCount + 2);i++) sim_tick();
+				sim_usb_take(NULL, SIM_USB_BUFFER);
+			}
+		}
+	}
+
+	// the keys were just busy: the fast rate
+	debounce_us = (16 + 8 * (kButtonUpDefaultDebounceCount + 2)) * sim_timer0_period_us();
+}
+
+static void open_device(struct device *d, uint32_t n, const char *dir)
+{
+	struct termios t;
+	struct epoll_event e;
+	const char *pts;
+
+	d->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+	if(d->master < 0 || grantpt(d->master) || unlockpt(d->master) || !(pts = ptsname(d->master))) {
+		perror("pty");
+		exit(2);
+	}
+
+	// held open so the master never hangs up between clients
+	d->slave = open(pts, O_RDWR | O_NOCTTY);
+	if(d->slave < 0) { perror(pts); exit(2); }
+	tcgetattr(d->slave, &t);
+	cfmakeraw(&t);
+	tcsetattr(d->slave, TCSANOW, &t);
+
+	if(dir) {
+		snprintf(d->link, sizeof(d->link), "%s/mk%u", dir, n);
+		unlink(d->link);
+		if(symlink(pts, d->link)) { perror(d->link); exit(2); }
+	}
+
+	d->state = malloc(STATE_SIZE);
+	if(!d->state) { perror("state"); exit(2); }
+	memcpy(d->state, booted, STATE_SIZE);
+
+	e.events = EPOLLIN;
+	e.data.u64 = DEVICE | n;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, d->master, &e);
+
+	printf("mk%u %s\n", n, pts);
+}
+
+static int watch(int fd)
+{
+	struct epoll_event e;
+
+	e.events = EPOLLIN;
+	e.data.u64 = fd;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &e);
+}
+
+
+// commands
+// ===============================================================
+// stdin is only read while no sleep holds the commands, and leaves the
+// epoll set meanwhile (a closed pipe would keep waking it). epoll takes
+// no plain files, a script redirected from one is read between waits
+static void commands_listen(void)
+{
+	uint8_t want = input && !holding;
+
+	if(input_file || want == listening) return;
+	if(want) watch(0);
+	else epoll_ctl(epfd, EPOLL_CTL_DEL, 0, NULL);
+	listening = want;
+}
+
+static void command(char *line)
+{
+	char dev[16];
+	unsigned x, y, down, ms;
+	uint32_t i, n;
+	struct itimerspec t;
+
+	if(sscanf(line, "key %15s %u %u %u", dev, &x, &y, &down) == 4) {
+		if(x >= size_x || y >= size_y || !keys[x][y].wired) {
+			fprintf(stderr, "vgrid: no key %u,%u\n", x, y);
+			return;
+		}
+		if(!strcmp(dev, "*")) {
+			for(i=0;i<count;i++) key(devices + i, x, y, down != 0);
+			return;
+		}
+		n = strtoul(dev + (strncmp(dev, "mk", 2) ? 0 : 2), NULL, 10);
+		if(n < count) key(devices + n, x, y, down != 0);
+		else fprintf(stderr, "vgrid: no device %s\n", dev);
+	}
+	else if(sscanf(line, "sleep %u", &ms) == 1) {
+		memset(&t, 0, sizeof(t));
+		t.it_value.tv_sec = ms / 1000;
+		t.it_value.tv_nsec = (ms % 1000) * 1000000L + 1;
+		timerfd_settime(sleeper, 0, &t, NULL);
+		holding = 1;
+		commands_listen();
+	}
+	else if(!strncmp(line, "quit", 4)) quitting = 1;
+	else if(line[0] && line[0] != '#') fprintf(stderr, "vgrid: %s?\n", line);
+}
+
+// whole lines until a sleep holds the rest
+static void commands_run(void)
+{
+	char *end;
+	uint32_t n;
+
+	while(!holding && !quitting && (end = memchr(commands, '\n', commands_len))) {
+		*end = 0;
+		n = end + 1 - commands;
+		command(commands);
+		memmove(commands, commands + n, commands_len - n);
+		commands_len -= n;
+	}
+}
+
+static void commands_read(void)
+{
+	ssize_t n;
+
+	n = read(0, commands + commands_len, sizeof(commands) - 1 - commands_len);
+	if(n <= 0) {
+		input = 0;
+		commands_listen();
+		if(commands_len && commands[commands_len-1] != '\n')
+			commands[commands_len++] = '\n';					// last line unterminated
+	}
+	else commands_len += n;
+
+	if(commands_len == sizeof(commands) - 1 && !memchr(commands, '\n', commands_len))
+		commands_len = 0;										// no line that long
+	commands_run();
+}
+
+
+// ===============================================================
+int main(int argc, char **argv)
+{
+	struct epoll_event ev[64];
+	struct device *d;
+	struct rlimit rl;
+	const char *dir = NULL;
+	sigset_t stop;
+	uint64_t expired;
+	uint32_t i, busy;
+	int arg, n, j, signals;
+
+	count = 1;
+	for(arg=1;arg<argc && argv[arg][0] == '-';arg++) {
+		if(!strcmp(argv[arg], "-n") && arg + 1 < argc) count = atoi(argv[++arg]);
+		else if(!strcmp(argv[arg], "-l") && arg + 1 < argc) dir = argv[++arg];
+		else break;
+	}
+	if(argc - arg != 1 || !count) {
+		fprintf(stderr, "usage: vgrid [-n devices] [-l dir] <variant>\n");
+		return 2;
+	}
+	variant = argv[arg];
+
+	// two descriptors a device
+	if(!getrlimit(RLIMIT_NOFILE, &rl)) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	fresh = malloc(STATE_SIZE);
+	booted = malloc(STATE_SIZE);
+	devices = calloc(count, sizeof(*devices));
+	if(!fresh || !booted || !devices) { perror("vgrid"); return 2; }
+	memcpy(fresh, __start_vgrid_state, STATE_SIZE);
+
+	learn_keys();
+	memcpy(__start_vgrid_state, fresh, STATE_SIZE);
+	sim_boot();
+	memcpy(booted, __start_vgrid_state, STATE_SIZE);
+
+	sigemptyset(&stop);
+	sigaddset(&stop, SIGINT);
+	sigaddset(&stop, SIGTERM);
+	sigprocmask(SIG_BLOCK, &stop, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	epfd = epoll_create1(0);
+	ticker = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	sleeper = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	signals = signalfd(-1, &stop, SFD_NONBLOCK);
+	watch(ticker);
+	watch(sleeper);
+	watch(signals);
+	input_file = watch(0) != 0;
+	listening = !input_file;
+
+	for(i=0;i<count;i++) open_device(devices + i, i, dir);
+	fprintf(stderr, "vgrid: %u x %s %ux%u, %zu bytes a device\n", count, variant, size_x, size_y, STATE_SIZE);
+	fflush(stdout);
+
+	while(!quitting) {
+		n = epoll_wait(epfd, ev, 64, input_file && input && !holding ? 0 : -1);
+		if(n < 0 && errno != EINTR) { perror("epoll"); break; }
+
+		for(j=0;j<n;j++) {
+			if(ev[j].data.u64 & DEVICE) {
+				d = devices + (uint32_t)ev[j].data.u64;
+				if(ev[j].events & EPOLLIN) receive(d);
+				if(ev[j].events & EPOLLOUT) {
+					use(d);
+					collect(d, 1);
+				}
+			}
+			else if(ev[j].data.u64 == 0) commands_read();
+			else if(ev[j].data.u64 == signals) quitting = 1;
+			else if(ev[j].data.u64 == sleeper) {
+				read(sleeper, &expired, sizeof(expired));
+				holding = 0;
+				commands_run();
+				commands_listen();
+			}
+			else if(read(ticker, &expired, sizeof(expired)) == sizeof(expired)) {
+				for(i=busy=0;i<count;i++) {
+					if(!devices[i].busy_us) continue;
+					tick(devices + i, expired * TICK_US);
+					busy += devices[i].busy_us != 0;
+				}
+				if(!busy) ticking(0);
+			}
+		}
+		if(input_file && input && !holding) commands_read();
+	}
+
+	for(i=0;i<count;i++)
+		if(devices[i].link[0]) unlink(devices[i].link);
+	return 0;
+}
@@ -0,0 +1,39 @@
+/************************************************************************
+version: tilt
+*************************************************************************
+tilt on adc 0-1. see ../common/variant.h
+*/
+
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#define AUX AUX_TILT
+#define ROTATE_40H 0
+#define VARIBRIGHT 0
+
+#ifndef GRIDS
+#define SIZE_X 16
+#define SIZE_Y 16
+#define GRIDS 4
+#endif
+
+#define SLEEP 1
+#define RX_TIMEOUT 250		// 4ms, a few usb frames
+#define RX_SLICE 8
+
+// firmware version: tilt
+#define FW_VERSION 2
+
+// tuning
+#define KEY_REFRESH_RATE 15
+#define KEY_PRESCALE 1024
+#define KEY_SETTLE_US 2
+#define KEY_IDLE_RATE 15		// a row a ms already, no backing off
+#define KEY_HOLD_MS 250
+#define AUX_REFRESH_RATE 100
+#define AUX_PRESCALE 256
+
+#define kButtonDownDefaultDebounceCount 1
+#define kButtonUpDefaultDebounceCount   4
+
+#endif